@@ -0,0 +1,36 @@
+#pragma once
+#include <cstddef>
+#include <cstdint>
+#include <new>
+
+// std::allocator only guarantees alignof(max_align_t) before C++17; this one
+// lets node arrays start on a cache line boundary.
+template <typename T, std::size_t Align = 64>
+struct AlignedAllocator {
+  typedef T value_type;
+
+  template <typename U> struct rebind { typedef AlignedAllocator<U, Align> other; };
+
+  AlignedAllocator() {}
+  template <typename U> AlignedAllocator(const AlignedAllocator<U, Align>&) {}
+
+  T* allocate(std::size_t n) {
+    // over-allocate and keep the raw pointer right before the aligned block
+    std::size_t bytes = n * sizeof(T) + Align + sizeof(void*);
+    char* raw = static_cast<char*>(::operator new(bytes));
+    std::uintptr_t p = reinterpret_cast<std::uintptr_t>(raw + sizeof(void*));
+    p = (p + Align - 1) & ~(std::uintptr_t)(Align - 1);
+    reinterpret_cast<void**>(p)[-1] = raw;
+    return reinterpret_cast<T*>(p);
+  }
+
+  void deallocate(T* p, std::size_t) {
+    if(p) ::operator delete(reinterpret_cast<void**>(p)[-1]);
+  }
+};
+
+template <typename T, typename U, std::size_t A>
+bool operator==(const AlignedAllocator<T, A>&, const AlignedAllocator<U, A>&) { return true; }
+
+template <typename T, typename U, std::size_t A>
+bool operator!=(const AlignedAllocator<T, A>&, const AlignedAllocator<U, A>&) { return false; }
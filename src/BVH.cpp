@@ -0,0 +1,1002 @@
+#include "BVH.h"
+#include "ThreadPool.h"
+
+#include <algorithm>
+#include <cmath>
+#include <limits>
+#include <mutex>
+
+#if defined(__SSE2__) || defined(_M_X64) || (defined(_M_IX86_FP) && _M_IX86_FP >= 2)
+#define RT_USE_SSE 1
+#include <xmmintrin.h>
+#endif
+
+// per-thread traversal counters, RayTracer::render() sums them per tile
+RTStats& rtThreadStats() {
+  static thread_local RTStats stats;
+  return stats;
+}
+
+RTRay::RTRay(const glm::vec3& origin, const glm::vec3& dir) : o(origin), d(dir) {
+  for (int a = 0; a < 3; ++a) {
+    // keep the slab distances finite for axis-parallel rays
+    float da = std::fabs(dir[a]) < 1e-12f ? std::copysign(1e-12f, dir[a]) : dir[a];
+    invD[a] = 1.0f / da;
+    sign[a] = invD[a] < 0.f ? 1 : 0;
+  }
+}
+
+
+
+bool BVH::intersectTriangle(const glm::vec3& ro, const glm::vec3& rd, const AccelTri& tri, float& t, float& u, float& v) {
+  const float EPS = 1e-7f;
+  const glm::vec3& e1 = tri.e1;
+  const glm::vec3& e2 = tri.e2;
+  glm::vec3 pvec = glm::cross(rd, e2);
+  float det = glm::dot(e1, pvec);
+
+  if (std::fabs(det) < EPS) return false;
+  float invDet = 1.f / det;
+
+  glm::vec3 tvec = ro - tri.v0;
+  u = glm::dot(tvec, pvec) * invDet;
+  if (u < 0.f || u > 1.f) return false;
+
+  glm::vec3 qvec = glm::cross(tvec, e1);
+  v = glm::dot(rd, qvec) * invDet;
+  if (v < 0.f || (u + v) > 1.f) return false;
+
+  t = glm::dot(e2, qvec) * invDet;
+  return t > EPS;
+}
+
+RTAABB BVH::triAABB(const RTGeometry& tris, int i) {
+  const glm::vec3& p0 = tris.p(i, 0);
+  const glm::vec3& p1 = tris.p(i, 1);
+  const glm::vec3& p2 = tris.p(i, 2);
+  RTAABB b;
+  b.bmin = glm::min(p0, glm::min(p1, p2));
+  b.bmax = glm::max(p0, glm::max(p1, p2));
+  return b;
+}
+
+RTAABB BVH::mergeAABB(const RTAABB& a, const RTAABB& b) {
+  RTAABB o;
+  o.bmin = glm::min(a.bmin, b.bmin);
+  o.bmax = glm::max(a.bmax, b.bmax);
+  return o;
+}
+
+glm::vec3 BVH::triCentroid(const RTGeometry& tris, int i) {
+  return (tris.p(i, 0) + tris.p(i, 1) + tris.p(i, 2)) * (1.0f/3.0f);
+}
+
+float BVH::surfaceArea(const RTAABB& b) {
+  glm::vec3 e = b.bmax - b.bmin;
+  if(e.x < 0.f || e.y < 0.f || e.z < 0.f) return 0.f;
+  return 2.f * (e.x*e.y + e.y*e.z + e.z*e.x);
+}
+
+void BVH::build(const RTGeometry& tris, BVHBuildMode mode, BVHLayout layout, ThreadPool* pool) {
+  _buildMode = mode;
+  _layout = layout;
+  _nodes.clear();
+  _nodes4.clear();
+  _nodes4q.clear();
+  _tris4.clear();
+  _triCount = 0;
+  _primIndices.clear();
+
+  if(tris.empty()) return;
+
+  // per-triangle bounds and centroids, computed once for the whole build
+  BuildInput in;
+  in.boxes.resize(tris.size());
+  in.centroids.resize(tris.size());
+  parallelChunks(pool, (int)tris.size(), PARALLEL_BUILD_MIN, [&](int begin, int end) {
+    for(int i=begin; i<end; ++i) {
+      in.boxes[i] = triAABB(tris, i);
+      in.centroids[i] = triCentroid(tris, i);
+    }
+  });
+
+  buildNodes(in, pool);
+
+  gatherTris(tris, pool);
+
+  buildWide();
+}
+
+void BVH::buildWide() {
+  _nodes4.clear();
+  _nodes4q.clear();
+  if(_layout != BVHLayout::Binary && !_nodes.empty()) {
+    _nodes4.reserve(_nodes.size() / 2 + 1);
+    collapse4(0);
+
+    if(_layout == BVHLayout::Wide4Quantized) {
+      if(quantize4()) Node4Array().swap(_nodes4);
+      else _nodes4q.clear();
+    }
+  }
+  updateStackSize();
+}
+
+// Children always come after their parent in every node array, so one
+// forward sweep gives each node its depth.
+void BVH::updateStackSize() {
+  int maxDepth = 0;
+  if(!_nodes4q.empty() || !_nodes4.empty()) {
+    size_t n = std::max(_nodes4q.size(), _nodes4.size());
+    std::vector<int> depth(n, 0);
+    for(size_t i = 0; i < n; ++i) {
+      maxDepth = std::max(maxDepth, depth[i]);
+      for(int c = 0; c < 4; ++c) {
+        int child = _nodes4q.empty() ? (_nodes4[i].count[c] == 0 ? _nodes4[i].child[c] : 0)
+                                     : std::max(_nodes4q[i].child[c], 0);
+        if(child > 0) depth[child] = depth[i] + 1;
+      }
+    }
+    _stackSize = 3 * maxDepth + 1;
+    return;
+  }
+
+  std::vector<int> depth(_nodes.size(), 0);
+  for(size_t i = 0; i < _nodes.size(); ++i) {
+    maxDepth = std::max(maxDepth, depth[i]);
+    if(_nodes[i].count > 0) continue;
+    depth[i + 1] = depth[_nodes[i].rightOrFirst] = depth[i] + 1;
+  }
+  _stackSize = maxDepth + 1;
+}
+
+// intersection records in leaf order, so leaves read them contiguously
+void BVH::gatherTris(const RTGeometry& tris, ThreadPool* pool) {
+  _triCount = (int)tris.size();
+  _tris4.assign((_triCount + 3) / 4, AccelTri4());
+
+  // whole groups per chunk, so no two threads write the same group
+  int groups = (int)_tris4.size();
+  parallelChunks(pool, groups, PARALLEL_BUILD_MIN / 4, [&](int begin, int end) {
+    for(int i=begin*4; i<std::min(end*4, _triCount); ++i) {
+      const glm::uvec3& idx = tris.indices[_primIndices[i]];
+      const glm::vec3& p0 = tris.positions[idx[0]];
+      glm::vec3 e1 = tris.positions[idx[1]] - p0;
+      glm::vec3 e2 = tris.positions[idx[2]] - p0;
+      AccelTri4& g = _tris4[i >> 2];
+      int l = i & 3;
+      g.v0x[l] = p0.x; g.v0y[l] = p0.y; g.v0z[l] = p0.z;
+      g.e1x[l] = e1.x;     g.e1y[l] = e1.y;     g.e1z[l] = e1.z;
+      g.e2x[l] = e2.x;     g.e2y[l] = e2.y;     g.e2z[l] = e2.z;
+    }
+  });
+}
+
+BVH::AccelTri BVH::triAt(int slot) const {
+  const AccelTri4& g = _tris4[slot >> 2];
+  int l = slot & 3;
+  AccelTri t;
+  t.v0 = glm::vec3(g.v0x[l], g.v0y[l], g.v0z[l]);
+  t.e1 = glm::vec3(g.e1x[l], g.e1y[l], g.e1z[l]);
+  t.e2 = glm::vec3(g.e2x[l], g.e2y[l], g.e2z[l]);
+  return t;
+}
+
+void BVH::buildFromBoxes(const std::vector<RTAABB>& boxes, BVHBuildMode mode) {
+  _buildMode = mode;
+  _layout = BVHLayout::Binary;
+  _nodes.clear();
+  _nodes4.clear();
+  _nodes4q.clear();
+  _tris4.clear();
+  _triCount = 0;
+  _primIndices.clear();
+
+  if(boxes.empty()) return;
+
+  BuildInput in;
+  in.boxes = boxes;
+  in.centroids.resize(boxes.size());
+  for(size_t i=0; i<boxes.size(); ++i)
+    in.centroids[i] = 0.5f * (boxes[i].bmin + boxes[i].bmax);
+
+  buildNodes(in, nullptr);  updateStackSize();
+}
+
+void BVH::buildNodes(const BuildInput& in, ThreadPool* pool) {
+  int n = (int)in.boxes.size();
+  _primIndices.resize(n);
+  for (int i = 0; i < n; ++i) _primIndices[i] = i;
+
+  _nodes.reserve(n * 2);
+  if(_buildMode == BVHBuildMode::LBVH || _buildMode == BVHBuildMode::LBVHTreelet)
+    buildLBVH(in, pool, _buildMode == BVHBuildMode::LBVHTreelet);
+  else if(pool && pool->size() > 1 && n >= PARALLEL_BUILD_MIN)
+    buildParallel(in, *pool);
+  else
+    buildRecursive(in, _nodes, 0, n);
+
+  _builtCost = sahCost();
+}
+
+// The top levels are split breadth-first: nodes big enough get their
+// binning spread over the pool, the other nodes of a level are split in
+// parallel, one per task. Nodes below subtreeMax primitives become
+// subtrees, each built serially by one task into its own array. Splits
+// only permute the primitive range of their node, so every step sees the
+// same input as in the serial build and makes the same choice.
+void BVH::buildParallel(const BuildInput& in, ThreadPool& pool) {
+  int n = (int)in.boxes.size();
+  int subtreeMax = std::max(PARALLEL_BUILD_MIN / 4, n / (pool.size() * 8));
+
+  std::vector<TopNode> top(1);
+  top[0].count = n;
+
+  std::vector<int> subtreeRoots;
+  std::vector<int> frontier;
+  if(n > subtreeMax) frontier.push_back(0);
+  else {
+    top[0].subtree = 0;
+    subtreeRoots.push_back(0);
+  }
+
+  while(!frontier.empty()) {
+    std::vector<int> mids(frontier.size(), -1);
+    std::vector<int> small;
+    for(size_t i=0; i<frontier.size(); ++i) {
+      TopNode& t = top[frontier[i]];
+      if(t.count >= PARALLEL_BIN_MIN) mids[i] = chooseSplit(in, t.start, t.count, t.bounds, &pool);
+      else small.push_back((int)i);
+    }
+    pool.parallelFor((int)small.size(), [&](int k) {
+      TopNode& t = top[frontier[small[k]]];
+      mids[small[k]] = chooseSplit(in, t.start, t.count, t.bounds, nullptr);
+    });
+
+    std::vector<int> next;
+    for(size_t i=0; i<frontier.size(); ++i) {
+      if(mids[i] < 0) continue; // leaf
+
+      int ti = frontier[i];
+      int start = top[ti].start, count = top[ti].count;
+      for(int side=0; side<2; ++side) {
+        TopNode child;
+        child.start = side ? mids[i] : start;
+        child.count = side ? start + count - mids[i] : mids[i] - start;
+
+        int ci = (int)top.size();
+        if(child.count > subtreeMax) next.push_back(ci);
+        else {
+          child.subtree = (int)subtreeRoots.size();
+          subtreeRoots.push_back(ci);
+        }
+        top.push_back(child);
+        if(side) top[ti].right = ci; else top[ti].left = ci;
+      }
+    }
+    frontier.swap(next);
+  }
+
+  std::vector<NodeArray> subtrees(subtreeRoots.size());
+  pool.parallelFor((int)subtreeRoots.size(), [&](int si) {
+    const TopNode& t = top[subtreeRoots[si]];
+    subtrees[si].reserve(t.count * 2);
+    buildRecursive(in, subtrees[si], t.start, t.count);
+  });
+
+  emitTop(top, 0, subtrees);
+}
+
+// Appends the top node ti and everything below it depth-first, the layout
+// buildRecursive() produces
+int BVH::emitTop(const std::vector<TopNode>& top, int ti, const std::vector<NodeArray>& subtrees) {
+  const TopNode& t = top[ti];
+  int nodeIdx = (int)_nodes.size();
+
+  if(t.subtree >= 0) {
+    for(const Node& node : subtrees[t.subtree]) {
+      _nodes.push_back(node);
+      if(node.count == 0) _nodes.back().rightOrFirst += nodeIdx;
+    }
+    return nodeIdx;
+  }
+
+  _nodes.push_back(Node());
+  _nodes[nodeIdx].bmin = t.bounds.bmin;
+  _nodes[nodeIdx].bmax = t.bounds.bmax;
+
+  if(t.left < 0) {
+    _nodes[nodeIdx].rightOrFirst = t.start;
+    _nodes[nodeIdx].count = t.count;
+    return nodeIdx;
+  }
+
+  emitTop(top, t.left, subtrees);
+  int right = emitTop(top, t.right, subtrees);
+  _nodes[nodeIdx].rightOrFirst = right;
+  _nodes[nodeIdx].count = 0;
+  return nodeIdx;
+}
+
+bool BVH::refit(const RTGeometry& tris, float maxCostGrowth, ThreadPool* pool) {
+  if((int)tris.size() != _triCount) {
+    build(tris, _buildMode, _layout, pool);
+    return false;
+  }
+  if(tris.empty()) return true;
+
+  gatherTris(tris, pool);
+
+  // children are always stored after their parent, so a reverse sweep
+  // sees both children before the node itself
+  for(int ni=(int)_nodes.size()-1; ni>=0; --ni) {
+    Node& node = _nodes[ni];
+    RTAABB b;
+    if(node.count > 0) {
+      for(int i=0; i<node.count; ++i)
+        b = mergeAABB(b, triAABB(tris, _primIndices[node.rightOrFirst + i]));
+    } else {
+      const Node& l = _nodes[ni + 1];
+      const Node& r = _nodes[node.rightOrFirst];
+      b.bmin = glm::min(l.bmin, r.bmin);
+      b.bmax = glm::max(l.bmax, r.bmax);
+    }
+    node.bmin = b.bmin;
+    node.bmax = b.bmax;
+  }
+
+  if(sahCost() > maxCostGrowth * _builtCost) {
+    build(tris, _buildMode, _layout, pool);
+    return false;
+  }
+
+  buildWide();
+  return true;
+}
+
+float BVH::sahCost() const {
+  if(_nodes.empty()) return 0.f;
+
+  const float C_TRAV = 1.0f;
+  const float C_ISECT = 1.0f;
+
+  float cost = 0.f;
+  for(const Node& node : _nodes) {
+    RTAABB b; b.bmin = node.bmin; b.bmax = node.bmax;
+    float area = surfaceArea(b);
+    cost += node.count > 0 ? C_ISECT * node.count * area : C_TRAV * area;
+  }
+
+  RTAABB root = bounds();
+  float rootArea = surfaceArea(root);
+  return rootArea > 0.f ? cost / rootArea : 0.f;
+}
+
+RTAABB BVH::bounds() const {
+  RTAABB b;
+  if(_nodes.empty()) return b;
+  b.bmin = _nodes[0].bmin;
+  b.bmax = _nodes[0].bmax;
+  return b;
+}
+
+bool BVH::intersect(const RTRay& ray, RTHit& hit, float tMax) const {
+  if(wide()) return intersect4(ray, hit, tMax);
+  return intersect2(ray, hit, tMax);
+}
+
+bool BVH::occluded(const RTRay& ray, float tMax) const {
+  if(wide()) return occluded4(ray, tMax);
+  return occluded2(ray, tMax);
+}
+
+int BVH::buildRecursive(const BuildInput& in, NodeArray& nodes, int start, int count) {
+  int nodeIdx = (int)nodes.size();
+  nodes.push_back(Node());
+
+  RTAABB bounds;
+  int mid = chooseSplit(in, start, count, bounds, nullptr);
+
+  nodes[nodeIdx].bmin = bounds.bmin;
+  nodes[nodeIdx].bmax = bounds.bmax;
+
+  if(mid < 0) {
+    nodes[nodeIdx].rightOrFirst = start;
+    nodes[nodeIdx].count = count;
+    return nodeIdx;
+  }
+
+  int leftCount  = mid - start;
+  int rightCount = count - leftCount;
+
+  // depth-first: the left child lands right after its parent
+  buildRecursive(in, nodes, start, leftCount);
+  int right = buildRecursive(in, nodes, mid, rightCount);
+
+  nodes[nodeIdx].rightOrFirst = right;
+  nodes[nodeIdx].count = 0; // internal
+  return nodeIdx;
+}
+
+// Bounds of the node's primitives and the split point of its range, which
+// gets partitioned around it; -1 keeps the node as a leaf
+int BVH::chooseSplit(const BuildInput& in, int start, int count, RTAABB& bounds, ThreadPool* pool) {
+  auto rangeBounds = [&](int begin, int end, RTAABB& b, RTAABB& cb) {
+    for(int i=begin; i<end; ++i) {
+      int ti = _primIndices[start + i];
+      b = mergeAABB(b, in.boxes[ti]);
+      cb.bmin = glm::min(cb.bmin, in.centroids[ti]);
+      cb.bmax = glm::max(cb.bmax, in.centroids[ti]);
+    }
+  };
+
+  if(count < PARALLEL_BIN_MIN) pool = nullptr;
+
+  bounds = RTAABB();
+  RTAABB centroidBounds;
+  if(!pool) rangeBounds(0, count, bounds, centroidBounds);
+  else {
+    std::mutex m;
+    parallelChunks(pool, count, PARALLEL_BUILD_MIN, [&](int begin, int end) {
+      RTAABB b, cb;
+      rangeBounds(begin, end, b, cb);
+      std::lock_guard<std::mutex> lk(m);
+      bounds = mergeAABB(bounds, b);
+      centroidBounds = mergeAABB(centroidBounds, cb);
+    });
+  }
+
+  const int LEAF_TRI_COUNT = 4;
+  glm::vec3 ext = centroidBounds.bmax - centroidBounds.bmin;
+  bool flat = ext.x < 1e-6f && ext.y < 1e-6f && ext.z < 1e-6f;
+
+  int mid = -1;
+  if(!flat && _buildMode == BVHBuildMode::SAH) {
+    if(!splitSAH(in, start, count, bounds, centroidBounds, mid, pool) && count > MAX_LEAF_TRI_COUNT)
+      mid = splitMedian(in, start, count, centroidBounds);
+  } else if(!flat && count > LEAF_TRI_COUNT) {
+    mid = splitMedian(in, start, count, centroidBounds);
+  }
+  return mid;
+}
+
+int BVH::splitMedian(const BuildInput& in, int start, int count, const RTAABB& centroidBounds) {
+  glm::vec3 ext = centroidBounds.bmax - centroidBounds.bmin;
+
+  // choose split axis
+  int axis = 0;
+  if(ext.y > ext.x) axis = 1;
+  if(ext.z > ext[axis]) axis = 2;
+
+  int mid = start + count/2;
+
+  std::nth_element(
+    _primIndices.begin() + start,
+    _primIndices.begin() + mid,
+    _primIndices.begin() + start + count,
+    [&](int ia, int ib) {
+      return in.centroids[ia][axis] < in.centroids[ib][axis];
+    }
+  );
+
+  return mid;
+}
+
+// Counts the primitives [start + begin, start + end) of _primIndices into
+// SAH_BINS slabs per axis (axes without extent are left empty)
+void BVH::binCentroids(const BuildInput& in, int begin, int end, const RTAABB& centroidBounds, Bin bins[3][SAH_BINS]) const {
+  for(int axis=0; axis<3; ++axis) {
+    float lo = centroidBounds.bmin[axis];
+    float extent = centroidBounds.bmax[axis] - lo;
+    if(extent < 1e-6f) continue;
+    float scale = SAH_BINS / extent;
+
+    Bin* axisBins = bins[axis];
+    for(int i=begin; i<end; ++i) {
+      int ti = _primIndices[i];
+      int b = std::min(SAH_BINS - 1, (int)((in.centroids[ti][axis] - lo) * scale));
+      axisBins[b].count++;
+      axisBins[b].box = mergeAABB(axisBins[b].box, in.boxes[ti]);
+    }
+  }
+}
+
+// Binned SAH: bucket the centroids into SAH_BINS slabs per axis and evaluate
+// the split between every pair of neighbouring slabs. Returns false when
+// keeping the node as a leaf is cheaper (or no split separates anything).
+// With a pool every thread bins a chunk of the range, the bins are merged.
+bool BVH::splitSAH(const BuildInput& in, int start, int count, const RTAABB& bounds, const RTAABB& centroidBounds, int& mid,
+                   ThreadPool* pool) {
+  const float C_TRAV = 1.0f;
+  const float C_ISECT = 1.0f;
+
+  float parentArea = surfaceArea(bounds);
+  if(parentArea <= 0.f) return false;
+
+  Bin bins[3][SAH_BINS];
+  if(!pool) binCentroids(in, start, start + count, centroidBounds, bins);
+  else {
+    std::mutex m;
+    parallelChunks(pool, count, PARALLEL_BUILD_MIN, [&](int begin, int end) {
+      Bin local[3][SAH_BINS];
+      binCentroids(in, start + begin, start + end, centroidBounds, local);
+
+      std::lock_guard<std::mutex> lk(m);
+      for(int axis=0; axis<3; ++axis)
+        for(int b=0; b<SAH_BINS; ++b) {
+          bins[axis][b].count += local[axis][b].count;
+          bins[axis][b].box = mergeAABB(bins[axis][b].box, local[axis][b].box);
+        }
+    });
+  }
+
+  float bestCost = std::numeric_limits<float>::infinity();
+  int bestAxis = -1;
+  int bestBin = -1;
+
+  for(int axis=0; axis<3; ++axis) {
+    if(centroidBounds.bmax[axis] - centroidBounds.bmin[axis] < 1e-6f) continue;
+    const Bin* axisBins = bins[axis];
+
+    // sweep from the right, then evaluate while sweeping from the left
+    float rightArea[SAH_BINS];
+    int rightCount[SAH_BINS];
+    RTAABB acc;
+    int n = 0;
+    for(int b=SAH_BINS-1; b>0; --b) {
+      acc = mergeAABB(acc, axisBins[b].box);
+      n += axisBins[b].count;
+      rightArea[b] = surfaceArea(acc);
+      rightCount[b] = n;
+    }
+
+    acc = RTAABB();
+    n = 0;
+    for(int b=0; b<SAH_BINS-1; ++b) {
+      acc = mergeAABB(acc, axisBins[b].box);
+      n += axisBins[b].count;
+      if(n == 0 || rightCount[b+1] == 0) continue;
+
+      float cost = C_TRAV + C_ISECT * (n * surfaceArea(acc) + rightCount[b+1] * rightArea[b+1]) / parentArea;
+      if(cost < bestCost) {
+        bestCost = cost;
+        bestAxis = axis;
+        bestBin = b;
+      }
+    }
+  }
+
+  if(bestAxis < 0) return false;
+  if(count <= MAX_LEAF_TRI_COUNT && bestCost >= C_ISECT * count) return false;
+
+  float lo = centroidBounds.bmin[bestAxis];
+  float scale = SAH_BINS / (centroidBounds.bmax[bestAxis] - lo);
+
+  auto it = std::partition(
+    _primIndices.begin() + start,
+    _primIndices.begin() + start + count,
+    [&](int ti) {
+      int b = std::min(SAH_BINS - 1, (int)((in.centroids[ti][bestAxis] - lo) * scale));
+      return b <= bestBin;
+    }
+  );
+
+  mid = (int)(it - _primIndices.begin());
+  return mid > start && mid < start + count;
+}
+
+
+// Slab test of one ray against the four boxes of a BVH4 node. Returns a bit
+// mask of the children hit before tMax, their entry distances in tNear.
+int BVH::intersectAABB4(const RTRay& ray, const Node4& node, float tMax, float tNear[4])
+{
+  const float* nearX = ray.sign[0] ? node.bmaxX : node.bminX;
+  const float* farX  = ray.sign[0] ? node.bminX : node.bmaxX;
+  const float* nearY = ray.sign[1] ? node.bmaxY : node.bminY;
+  const float* farY  = ray.sign[1] ? node.bminY : node.bmaxY;
+  const float* nearZ = ray.sign[2] ? node.bmaxZ : node.bminZ;
+  const float* farZ  = ray.sign[2] ? node.bminZ : node.bmaxZ;
+
+#ifdef RT_USE_SSE
+  const __m128 ox = _mm_set1_ps(ray.o.x), oy = _mm_set1_ps(ray.o.y), oz = _mm_set1_ps(ray.o.z);
+  const __m128 ix = _mm_set1_ps(ray.invD.x), iy = _mm_set1_ps(ray.invD.y), iz = _mm_set1_ps(ray.invD.z);
+
+  __m128 t0 = _mm_max_ps(
+    _mm_max_ps(_mm_mul_ps(_mm_sub_ps(_mm_load_ps(nearX), ox), ix),
+               _mm_mul_ps(_mm_sub_ps(_mm_load_ps(nearY), oy), iy)),
+    _mm_max_ps(_mm_mul_ps(_mm_sub_ps(_mm_load_ps(nearZ), oz), iz), _mm_setzero_ps()));
+  __m128 t1 = _mm_min_ps(
+    _mm_min_ps(_mm_mul_ps(_mm_sub_ps(_mm_load_ps(farX), ox), ix),
+               _mm_mul_ps(_mm_sub_ps(_mm_load_ps(farY), oy), iy)),
+    _mm_min_ps(_mm_mul_ps(_mm_sub_ps(_mm_load_ps(farZ), oz), iz), _mm_set1_ps(tMax)));
+  _mm_storeu_ps(tNear, t0);
+  return _mm_movemask_ps(_mm_cmple_ps(t0, t1));
+#else
+  int mask = 0;
+  for(int c=0; c<4; ++c) {
+    float t0 = std::max(std::max((nearX[c] - ray.o.x) * ray.invD.x, (nearY[c] - ray.o.y) * ray.invD.y),
+                        std::max((nearZ[c] - ray.o.z) * ray.invD.z, 0.f));
+    float t1 = std::min(std::min((farX[c] - ray.o.x) * ray.invD.x, (farY[c] - ray.o.y) * ray.invD.y),
+                        std::min((farZ[c] - ray.o.z) * ray.invD.z, tMax));
+    tNear[c] = t0;
+    if(t0 <= t1) mask |= 1 << c;
+  }
+  return mask;
+#endif
+}
+
+// Turns the binary subtree at binaryIdx into a BVH4 subtree: keep opening
+// the internal child with the largest surface area until four children are
+// gathered (or only leaves are left), then recurse into the internal ones.
+int BVH::collapse4(int binaryIdx) {
+  int children[4];
+  int n = 1;
+  children[0] = binaryIdx;
+
+  while(n < 4) {
+    int best = -1;
+    float bestArea = -1.f;
+    for(int c=0; c<n; ++c) {
+      const Node& bn = _nodes[children[c]];
+      if(bn.count > 0) continue;
+      RTAABB b; b.bmin = bn.bmin; b.bmax = bn.bmax;
+      float area = surfaceArea(b);
+      if(area > bestArea) { bestArea = area; best = c; }
+    }
+    if(best < 0) break;
+
+    int opened = children[best];
+    children[best] = opened + 1;
+    children[n++] = _nodes[opened].rightOrFirst;
+  }
+
+  int nodeIdx = (int)_nodes4.size();
+  _nodes4.push_back(Node4());
+
+  for(int c=0; c<4; ++c) {
+    Node4& node = _nodes4[nodeIdx];
+    if(c >= n) {
+      node.bminX[c] = node.bminY[c] = node.bminZ[c] =  std::numeric_limits<float>::infinity();
+      node.bmaxX[c] = node.bmaxY[c] = node.bmaxZ[c] = -std::numeric_limits<float>::infinity();
+      node.child[c] = 0;
+      node.count[c] = 0;
+      continue;
+    }
+
+    const Node& bn = _nodes[children[c]];
+    node.bminX[c] = bn.bmin.x; node.bminY[c] = bn.bmin.y; node.bminZ[c] = bn.bmin.z;
+    node.bmaxX[c] = bn.bmax.x; node.bmaxY[c] = bn.bmax.y; node.bmaxZ[c] = bn.bmax.z;
+    node.count[c] = bn.count;
+    node.child[c] = bn.count > 0 ? bn.rightOrFirst : 0;
+  }
+
+  // children are filled in after the loop above: push_back may reallocate
+  for(int c=0; c<n; ++c) {
+    const Node& bn = _nodes[children[c]];
+    if(bn.count > 0) continue;
+    int child = collapse4(children[c]);
+    _nodes4[nodeIdx].child[c] = child;
+  }
+
+  return nodeIdx;
+}
+
+
+#ifdef RT_USE_SSE
+// intersectTriangle() on the four lanes of a group, with the same operations
+// in the same order, so every lane gives the scalar test's t, u and v bit
+// for bit. Returns the mask of the lanes that hit.
+static inline int intersectTri4(const __m128 ro[3], const __m128 rd[3], const float* g,
+                                __m128& t, __m128& u, __m128& v)
+{
+  const __m128 v0x = _mm_load_ps(g),      v0y = _mm_load_ps(g + 4),  v0z = _mm_load_ps(g + 8);
+  const __m128 e1x = _mm_load_ps(g + 12), e1y = _mm_load_ps(g + 16), e1z = _mm_load_ps(g + 20);
+  const __m128 e2x = _mm_load_ps(g + 24), e2y = _mm_load_ps(g + 28), e2z = _mm_load_ps(g + 32);
+  const __m128 eps = _mm_set1_ps(1e-7f);
+  const __m128 zero = _mm_setzero_ps(), one = _mm_set1_ps(1.f);
+
+  // pvec = cross(rd, e2), det = dot(e1, pvec)
+  __m128 px = _mm_sub_ps(_mm_mul_ps(rd[1], e2z), _mm_mul_ps(rd[2], e2y));
+  __m128 py = _mm_sub_ps(_mm_mul_ps(rd[2], e2x), _mm_mul_ps(rd[0], e2z));
+  __m128 pz = _mm_sub_ps(_mm_mul_ps(rd[0], e2y), _mm_mul_ps(rd[1], e2x));
+  __m128 det = _mm_add_ps(_mm_add_ps(_mm_mul_ps(e1x, px), _mm_mul_ps(e1y, py)), _mm_mul_ps(e1z, pz));
+  __m128 absDet = _mm_andnot_ps(_mm_set1_ps(-0.f), det);
+  __m128 reject = _mm_cmplt_ps(absDet, eps);
+  __m128 invDet = _mm_div_ps(one, det);
+
+  // tvec = ro - v0, u = dot(tvec, pvec) * invDet
+  __m128 tx = _mm_sub_ps(ro[0], v0x), ty = _mm_sub_ps(ro[1], v0y), tz = _mm_sub_ps(ro[2], v0z);
+  u = _mm_mul_ps(_mm_add_ps(_mm_add_ps(_mm_mul_ps(tx, px), _mm_mul_ps(ty, py)), _mm_mul_ps(tz, pz)), invDet);
+  reject = _mm_or_ps(reject, _mm_or_ps(_mm_cmplt_ps(u, zero), _mm_cmpgt_ps(u, one)));
+
+  // qvec = cross(tvec, e1), v = dot(rd, qvec) * invDet
+  __m128 qx = _mm_sub_ps(_mm_mul_ps(ty, e1z), _mm_mul_ps(tz, e1y));
+  __m128 qy = _mm_sub_ps(_mm_mul_ps(tz, e1x), _mm_mul_ps(tx, e1z));
+  __m128 qz = _mm_sub_ps(_mm_mul_ps(tx, e1y), _mm_mul_ps(ty, e1x));
+  v = _mm_mul_ps(_mm_add_ps(_mm_add_ps(_mm_mul_ps(rd[0], qx), _mm_mul_ps(rd[1], qy)), _mm_mul_ps(rd[2], qz)), invDet);
+  reject = _mm_or_ps(reject, _mm_or_ps(_mm_cmplt_ps(v, zero), _mm_cmpgt_ps(_mm_add_ps(u, v), one)));
+
+  // t = dot(e2, qvec) * invDet
+  t = _mm_mul_ps(_mm_add_ps(_mm_add_ps(_mm_mul_ps(e2x, qx), _mm_mul_ps(e2y, qy)), _mm_mul_ps(e2z, qz)), invDet);
+  return _mm_movemask_ps(_mm_andnot_ps(reject, _mm_cmpgt_ps(t, eps)));
+}
+#endif
+
+// lanes of group g inside the leaf slots [first, end)
+static inline int leafLanes(int g, int first, int end)
+{
+  int lo = std::max(first - 4 * g, 0), hi = std::min(end - 4 * g, 4);
+  return ((1 << hi) - 1) & ~((1 << lo) - 1);
+}
+
+// Closest of the leaf's triangles, one group of four at a time. Like the
+// scalar loop, a hit has to be strictly closer than tMax and the lowest
+// slot wins a tie.
+bool BVH::intersectLeaf(const RTRay& ray, int first, int count, RTHit& hit, float& tMax) const
+{
+  bool any = false;
+  const int end = first + count;
+
+#ifdef RT_USE_SSE
+  const __m128 ro[3] = { _mm_set1_ps(ray.o.x), _mm_set1_ps(ray.o.y), _mm_set1_ps(ray.o.z) };
+  const __m128 rd[3] = { _mm_set1_ps(ray.d.x), _mm_set1_ps(ray.d.y), _mm_set1_ps(ray.d.z) };
+
+  for(int g = first >> 2; g <= (end - 1) >> 2; ++g) {
+    __m128 t4, u4, v4;
+    int mask = intersectTri4(ro, rd, _tris4[g].v0x, t4, u4, v4);
+    mask &= _mm_movemask_ps(_mm_cmplt_ps(t4, _mm_set1_ps(tMax))) & leafLanes(g, first, end);
+    if(!mask) continue;
+
+    alignas(16) float t[4], u[4], v[4];
+    _mm_store_ps(t, t4);
+    _mm_store_ps(u, u4);
+    _mm_store_ps(v, v4);
+    for(int l=0; l<4; ++l) {
+      if(!(mask & (1 << l)) || !(t[l] < tMax)) continue;
+      any = true;
+      tMax = t[l];
+      hit.t = t[l];
+      hit.u = u[l];
+      hit.v = v[l];
+      hit.prim = 4 * g + l;
+    }
+  }
+#else
+  for(int i=first; i<end; ++i) {
+    float t, u, v;
+    if(intersectTriangle(ray.o, ray.d, triAt(i), t, u, v)) {
+      if(t < tMax) {
+        any = true;
+        tMax = t;
+        hit.t = t;
+        hit.u = u;
+        hit.v = v;
+        hit.prim = i;
+      }
+    }
+  }
+#endif
+  return any;
+}
+
+bool BVH::intersect2(const RTRay& ray, RTHit& hit, float tMaxLimit) const
+{
+  if(_nodes.empty()) return false;
+
+  RTStats& st = rtThreadStats();
+
+  bool any = false;
+  float tMax = std::min(hit.t, tMaxLimit);
+
+  float tEntry;
+  st.boxTests++;
+  if(!intersectAABB(ray, _nodes[0], tMax, tEntry)) return false;
+
+  // far children waiting to be visited, with their entry distance
+  struct StackEntry {
+    int node;
+    float tEntry;
+  };
+  TraversalStack<StackEntry> stack(_stackSize);
+  int sp = 0;
+  int ni = 0;
+
+  for(;;) {
+    const Node& node = _nodes[ni];
+    st.nodesVisited++;
+
+    if(node.count > 0) {
+      st.triTests += node.count;
+      if(intersectLeaf(ray, node.rightOrFirst, node.count, hit, tMax)) any = true;
+    } else {
+      int nearIdx = ni + 1;
+      int farIdx = node.rightOrFirst;
+      float tNear, tFar;
+      bool hitNear = intersectAABB(ray, _nodes[nearIdx], tMax, tNear);
+      bool hitFar  = intersectAABB(ray, _nodes[farIdx], tMax, tFar);
+      st.boxTests += 2;
+
+      if(hitNear && hitFar) {
+        if(tFar < tNear) {
+          std::swap(nearIdx, farIdx);
+          std::swap(tNear, tFar);
+        }
+        stack[sp].node = farIdx;
+        stack[sp].tEntry = tFar;
+        ++sp;
+        ni = nearIdx;
+        continue;
+      }
+      if(hitNear) { ni = nearIdx; continue; }
+      if(hitFar)  { ni = farIdx;  continue; }
+    }
+
+    // pop the next far child that can still beat the closest hit
+    while(sp && stack[sp-1].tEntry > tMax) --sp;
+    if(!sp) break;
+    ni = stack[--sp].node;
+  }
+
+  return any;
+}
+
+bool BVH::intersect4(const RTRay& ray, RTHit& hit, float tMaxLimit) const
+{
+  if(!wide()) return false;
+
+  RTStats& st = rtThreadStats();
+
+  bool any = false;
+  float tMax = std::min(hit.t, tMaxLimit);
+
+  // inner nodes (count == 0) and leaves waiting to be visited
+  struct StackEntry {
+    int ref;
+    int count;
+    float tEntry;
+  };
+  TraversalStack<StackEntry> stack(_stackSize);
+  int sp = 0;
+  stack[sp].ref = 0;
+  stack[sp].count = 0;
+  stack[sp].tEntry = 0.f;
+  ++sp;
+
+  while(sp) {
+    const StackEntry e = stack[--sp];
+    if(e.tEntry > tMax) continue;
+
+    st.nodesVisited++;
+
+    if(e.count > 0) {
+      st.triTests += e.count;
+      if(intersectLeaf(ray, e.ref, e.count, hit, tMax)) any = true;
+      continue;
+    }
+
+    Node4 scratch;
+    const Node4& node = node4At(e.ref, scratch);
+    st.boxTests += 4;
+
+    alignas(16) float tNear[4];
+    int mask = intersectAABB4(ray, node, tMax, tNear);
+    if(!mask) continue;
+
+    // sort the hit children far to near, so the nearest is popped first
+    int order[4];
+    int n = 0;
+    for(int c=0; c<4; ++c) {
+      if(!(mask & (1 << c))) continue;
+      int k = n++;
+      while(k > 0 && tNear[order[k-1]] < tNear[c]) {
+        order[k] = order[k-1];
+        --k;
+      }
+      order[k] = c;
+    }
+
+    for(int k=0; k<n; ++k) {
+      int c = order[k];
+      stack[sp].ref = node.child[c];
+      stack[sp].count = node.count[c];
+      stack[sp].tEntry = tNear[c];
+      ++sp;
+    }
+  }
+
+  return any;
+}
+
+bool BVH::occludedLeaf(const RTRay& ray, int first, int count, float tMax) const
+{
+  const int end = first + count;
+
+#ifdef RT_USE_SSE
+  const __m128 ro[3] = { _mm_set1_ps(ray.o.x), _mm_set1_ps(ray.o.y), _mm_set1_ps(ray.o.z) };
+  const __m128 rd[3] = { _mm_set1_ps(ray.d.x), _mm_set1_ps(ray.d.y), _mm_set1_ps(ray.d.z) };
+  const __m128 tMax4 = _mm_set1_ps(tMax);
+
+  for(int g = first >> 2; g <= (end - 1) >> 2; ++g) {
+    __m128 t, u, v;
+    int mask = intersectTri4(ro, rd, _tris4[g].v0x, t, u, v);
+    if(mask & _mm_movemask_ps(_mm_cmplt_ps(t, tMax4)) & leafLanes(g, first, end)) return true;
+  }
+#else
+  for(int i=first; i<end; ++i) {
+    float t, u, v;
+    if(intersectTriangle(ray.o, ray.d, triAt(i), t, u, v) && t < tMax) return true;
+  }
+#endif
+  return false;
+}
+
+bool BVH::occluded2(const RTRay& ray, float tMax) const
+{
+  if(_nodes.empty()) return false;
+
+  RTStats& st = rtThreadStats();
+
+  float tEntry;
+  st.boxTests++;
+  if(!intersectAABB(ray, _nodes[0], tMax, tEntry)) return false;
+
+  // no ordering needed: any hit ends the query
+  TraversalStack<int> stack(_stackSize);
+  int sp = 0;
+  stack[sp++] = 0;
+
+  while(sp) {
+    const Node& node = _nodes[stack[--sp]];
+    st.nodesVisited++;
+
+    if(node.count > 0) {
+      st.triTests += node.count;
+      if(occludedLeaf(ray, node.rightOrFirst, node.count, tMax)) return true;
+      continue;
+    }
+
+    int left = (int)(&node - _nodes.data()) + 1;
+    int right = node.rightOrFirst;
+    st.boxTests += 2;
+    if(intersectAABB(ray, _nodes[right], tMax, tEntry)) stack[sp++] = right;
+    if(intersectAABB(ray, _nodes[left], tMax, tEntry))  stack[sp++] = left;
+  }
+
+  return false;
+}
+
+bool BVH::occluded4(const RTRay& ray, float tMax) const
+{
+  if(!wide()) return false;
+
+  RTStats& st = rtThreadStats();
+
+  // a leaf child is tested as soon as its box is hit, so the stack only
+  // holds inner nodes
+  TraversalStack<int> stack(_stackSize);
+  int sp = 0;
+  stack[sp++] = 0;
+
+  while(sp) {
+    Node4 scratch;
+    const Node4& node = node4At(stack[--sp], scratch);
+    st.nodesVisited++;
+    st.boxTests += 4;
+
+    alignas(16) float tNear[4];
+    int mask = intersectAABB4(ray, node, tMax, tNear);
+
+    for(int c=0; c<4; ++c) {
+      if(!(mask & (1 << c))) continue;
+      if(node.count[c] > 0) {
+        st.nodesVisited++;
+        st.triTests += node.count[c];
+        if(occludedLeaf(ray, node.child[c], node.count[c], tMax)) return true;
+      } else {
+        stack[sp++] = node.child[c];
+      }
+    }
+  }
+
+  return false;
+}
@@ -0,0 +1,342 @@
+#pragma once
+#include <glm/glm.hpp>
+#include <algorithm>
+#include <cstdint>
+#include <memory>
+#include <string>
+#include <vector>
+#include "AlignedAllocator.h"
+#include "RTScene.h"
+
+class ThreadPool;
+
+struct RTAABB {
+  glm::vec3 bmin = glm::vec3( 1e30f);
+  glm::vec3 bmax = glm::vec3(-1e30f);
+};
+
+// ray with the per-ray constants of the slab test
+struct RTRay {
+  glm::vec3 o;
+  glm::vec3 d;
+  glm::vec3 invD;
+  int sign[3];
+
+  RTRay() = default;
+  RTRay(const glm::vec3& origin, const glm::vec3& dir);
+};
+
+// Traversal only records t, the barycentrics and the leaf slot of the
+// closest triangle; RayTracer::finalizeHit() fills in the shading
+// attributes once.
+struct RTHit {
+  float t = 1e30f;
+  float u = 0.f, v = 0.f;
+  int prim = -1;   // leaf slot in the BVH that was hit
+  int inst = -1;   // RTScene::instances index, -1 for RTScene::tris
+
+  glm::vec3 p;
+  glm::vec3 n;
+  glm::vec2 uv;
+  int matId = -1;
+};
+
+// Traversal counters of the last RayTracer::render() call
+struct RTStats {
+  unsigned long long rays = 0;
+  unsigned long long nodesVisited = 0;
+  unsigned long long boxTests = 0;
+  unsigned long long triTests = 0;
+
+  double nodesPerRay() const { return rays ? double(nodesVisited) / double(rays) : 0.0; }
+  double boxTestsPerRay() const { return rays ? double(boxTests) / double(rays) : 0.0; }
+  double triTestsPerRay() const { return rays ? double(triTests) / double(rays) : 0.0; }
+};
+
+// counters of the calling thread, bumped by every traversal
+RTStats& rtThreadStats();
+
+enum class BVHBuildMode {
+  Median,     // split the longest centroid axis at the median
+  SAH,        // binned surface area heuristic
+  LBVH,       // linear BVH over sorted Morton codes, fastest to build
+  LBVHTreelet // LBVH, then its treelets restructured for a lower SAH cost
+};
+
+enum class BVHLayout {
+  Binary, // the built binary tree
+  Wide4,  // binary tree collapsed into 4-wide nodes, boxes tested with SSE
+  Wide4Quantized // Wide4 with the child boxes stored as 8-bit offsets, half the node memory
+};
+
+// Bounding volume hierarchy over one set of triangles (or, for the top level
+// of the scene, over arbitrary boxes).
+class BVH {
+public:
+  // 32 bytes, two per cache line. Nodes are stored depth-first, so the left
+  // child of an internal node is always the next node.
+  struct alignas(32) Node {
+    glm::vec3 bmin;
+    int rightOrFirst = 0; // internal: index of the right child, leaf: first primitive slot
+    glm::vec3 bmax;
+    int count = 0;        // 0 for internal nodes
+  };
+  static_assert(sizeof(Node) == 32, "BVH::Node must stay 32 bytes");
+
+  // Four children per node, bounds stored per axis so one SSE op tests all
+  // four boxes. Unused slots have inverted (empty) bounds and never hit.
+  struct alignas(64) Node4 {
+    float bminX[4], bminY[4], bminZ[4];
+    float bmaxX[4], bmaxY[4], bmaxZ[4];
+    int child[4]; // internal: Node4 index, leaf: first triangle slot
+    int count[4]; // triangle count for leaves, 0 for internal children
+  };
+  static_assert(sizeof(Node4) == 128, "BVH::Node4 must stay two cache lines");
+
+  // Node4 in one cache line: the child boxes are 8-bit multiples of a
+  // power-of-two step per axis from the node's origin, rounded outwards so
+  // the decoded boxes always contain the exact ones. Leaf children pack
+  // their first slot and count into child (see Node4Q::leaf()); unused
+  // slots decode to empty boxes.
+  struct alignas(64) Node4Q {
+    float origin[3];
+    float scale[3];
+    uint8_t qlo[3][4]; // per axis, per child
+    uint8_t qhi[3][4];
+    int child[4];      // internal: Node4Q index, leaf: leaf(first, count)
+
+    static int leaf(int first, int count) { return -1 - (first * 8 + count - 1); }
+  };
+  static_assert(sizeof(Node4Q) == 64, "BVH::Node4Q must stay one cache line");
+
+  typedef std::vector<Node, AlignedAllocator<Node>> NodeArray;
+  typedef std::vector<Node4, AlignedAllocator<Node4>> Node4Array;
+  typedef std::vector<Node4Q, AlignedAllocator<Node4Q>> Node4QArray;
+
+  // With a pool of more than one thread, large inputs are built in
+  // parallel: the top levels are split with parallel binning, the subtrees
+  // below them are built as independent tasks. The tree is identical to
+  // the serial build's.
+  void build(const RTGeometry& tris, BVHBuildMode mode = BVHBuildMode::SAH, BVHLayout layout = BVHLayout::Wide4,
+             ThreadPool* pool = nullptr);
+
+  // Binary tree only, leaves reference box indices through primIndex()
+  void buildFromBoxes(const std::vector<RTAABB>& boxes, BVHBuildMode mode = BVHBuildMode::SAH);
+
+  // Same triangles (count and order) as the last build(), with moved
+  // vertices: recomputes the bounds bottom-up in one linear pass. When the
+  // refitted tree's SAH cost grew past maxCostGrowth times its cost right
+  // after the build, the tree is rebuilt instead. Returns false when it
+  // had to rebuild.
+  bool refit(const RTGeometry& tris, float maxCostGrowth = 1.5f, ThreadPool* pool = nullptr);
+
+  // SAH cost of the binary tree, relative to the root's surface area
+  float sahCost() const;
+
+  // Hash of the triangle positions, the only input the tree depends on
+  static uint64_t contentHash(const RTGeometry& tris);
+
+  // Writes the built tree (nodes and triangle order) to a versioned binary
+  // file, tagged with the contentHash() of the triangles it was built from.
+  // The file is written next to path and renamed, so readers never see a
+  // partial file.
+  bool save(const std::string& path, uint64_t hash) const;
+
+  // Maps a file written by save() and copies its tree when it matches tris
+  // (hash, count), mode and layout; false (and the BVH untouched) otherwise.
+  // The file is unmapped again before returning.
+  bool load(const std::string& path, const RTGeometry& tris, uint64_t hash,
+            BVHBuildMode mode, BVHLayout layout, ThreadPool* pool = nullptr);
+
+  bool empty() const { return _nodes.empty(); }
+  RTAABB bounds() const;
+
+  // closest hit closer than min(hit.t, tMax); only t, u, v and prim are set
+  bool intersect(const RTRay& ray, RTHit& hit, float tMax) const;
+
+  // any hit closer than tMax
+  bool occluded(const RTRay& ray, float tMax) const;
+
+  static const int MAX_PACKET = 32;
+
+  // intersect() for a packet of up to MAX_PACKET coherent rays (the camera
+  // rays of a 4x4 pixel block): the packet walks the BVH4 once, children
+  // no ray can enter are culled for all rays with one interval arithmetic
+  // test, and every ray keeps its own closest hit. Packets with mixed
+  // direction signs, and the binary layout, run ray by ray. Returns the
+  // mask of the rays whose hit was updated.
+  uint32_t intersectPacket(const RTRay* rays, int count, RTHit* hits, float tMax) const;
+
+  // true when all rays share their direction signs
+  static bool packetCoherent(const RTRay* rays, int count);
+
+  const NodeArray& nodes() const { return _nodes; }
+
+  // Entries a traversal of this tree can hold at once: depth + 1 for the
+  // binary nodes, 3 * depth + 1 for the 4-wide ones. Every build, refit
+  // and load sets it; the builders do not bound the depth.
+  int stackSize() const { return _stackSize; }
+
+  // Traversal stack for stackSize() entries: TRAVERSAL_STACK of them in
+  // place, enough for any tree up to that depth, on the heap only for a
+  // deeper one. load() rejects files whose tree needs the heap.
+  static const int TRAVERSAL_STACK = 128;
+
+  template<class T>
+  class TraversalStack {
+  public:
+    explicit TraversalStack(int size) : _data(_local) {
+      if(size > TRAVERSAL_STACK) {
+        _heap.reset(new T[size]);
+        _data = _heap.get();
+      }
+    }
+    T& operator[](int i) { return _data[i]; }
+
+  private:
+    T _local[TRAVERSAL_STACK];
+    std::unique_ptr<T[]> _heap;
+    T* _data;
+  };
+
+  // Resident size of the tree: the binary nodes (kept for refit() and
+  // save()), the wide nodes, the leaf triangles and the slot indices.
+  // traversalBytes() only counts what intersect() reads.
+  size_t memoryBytes() const;
+  size_t traversalBytes() const;
+
+  // original index (triangle or box) of a leaf slot
+  int primIndex(int slot) const { return _primIndices[slot]; }
+
+  static bool intersectAABB(const RTRay& ray, const Node& node, float tMax, float& tEntry);
+
+  // of triangle i of tris
+  static RTAABB triAABB(const RTGeometry& tris, int i);
+  static RTAABB mergeAABB(const RTAABB& a, const RTAABB& b);
+  static glm::vec3 triCentroid(const RTGeometry& tris, int i);
+  static float surfaceArea(const RTAABB& b);
+
+private:
+  // What the Moller-Trumbore test reads: one vertex and the two edges from it
+  struct AccelTri {
+    glm::vec3 v0;
+    glm::vec3 e1;
+    glm::vec3 e2;
+  };
+
+  // The same for four consecutive leaf slots, one per lane, so the leaf
+  // test runs four triangles per SSE op: slot s is lane s & 3 of group
+  // s >> 2. Lanes past the last triangle are degenerate and never hit.
+  struct alignas(16) AccelTri4 {
+    float v0x[4], v0y[4], v0z[4];
+    float e1x[4], e1y[4], e1z[4];
+    float e2x[4], e2y[4], e2z[4];
+  };
+  static_assert(sizeof(AccelTri4) == 9 * 16, "the leaf kernel loads AccelTri4 as nine packed vectors");
+
+  struct BuildInput {
+    std::vector<RTAABB> boxes;
+    std::vector<glm::vec3> centroids;
+  };
+
+  struct Bin {
+    RTAABB box;
+    int count = 0;
+  };
+
+  // Node of the top levels of a parallel build: either split further,
+  // a leaf, or the root of a subtree built by one task
+  struct TopNode {
+    RTAABB bounds;
+    int start = 0, count = 0;
+    int left = -1, right = -1;
+    int subtree = -1;
+  };
+
+  static const int SAH_BINS = 12;
+  static const int MAX_LEAF_TRI_COUNT = 8;
+  static const int PARALLEL_BUILD_MIN = 4096; // smaller inputs build serially
+  static const int PARALLEL_BIN_MIN = 16384;  // nodes binned by several threads
+
+  BVHBuildMode _buildMode = BVHBuildMode::SAH;
+  BVHLayout _layout = BVHLayout::Wide4;
+  float _builtCost = 0.f; // sahCost() right after the last build
+  int _stackSize = 0;
+
+  NodeArray _nodes;
+  Node4Array _nodes4;
+  Node4QArray _nodes4q; // replaces _nodes4 for Wide4Quantized
+
+  // Triangles in leaf order: a leaf covers slots [first, first + count)
+  // of both. _tris4 is all the traversal touches, _primIndices maps a slot
+  // back to the input triangle for the shading attributes of the final hit.
+  std::vector<AccelTri4, AlignedAllocator<AccelTri4>> _tris4;
+  std::vector<int> _primIndices;
+  int _triCount = 0;
+
+  AccelTri triAt(int slot) const;
+  static bool intersectTriangle(const glm::vec3& ro, const glm::vec3& rd, const AccelTri& tri, float& t, float& u, float& v);
+  static int intersectAABB4(const RTRay& ray, const Node4& node, float tMax, float tNear[4]);
+
+  void gatherTris(const RTGeometry& tris, ThreadPool* pool);
+  void buildNodes(const BuildInput& in, ThreadPool* pool);
+  void buildParallel(const BuildInput& in, ThreadPool& pool);
+  void buildLBVH(const BuildInput& in, ThreadPool* pool, bool optimizeTreelets);
+  int emitTop(const std::vector<TopNode>& top, int ti, const std::vector<NodeArray>& subtrees);
+  int buildRecursive(const BuildInput& in, NodeArray& nodes, int start, int count);
+  int chooseSplit(const BuildInput& in, int start, int count, RTAABB& bounds, ThreadPool* pool);
+  int splitMedian(const BuildInput& in, int start, int count, const RTAABB& centroidBounds);
+  bool splitSAH(const BuildInput& in, int start, int count, const RTAABB& bounds, const RTAABB& centroidBounds, int& mid,
+                ThreadPool* pool);
+  void binCentroids(const BuildInput& in, int begin, int end, const RTAABB& centroidBounds, Bin bins[3][SAH_BINS]) const;
+  int collapse4(int binaryIdx);
+
+  // the wide nodes of the layout from the binary ones
+  void buildWide();
+  // _stackSize from the depth of the nodes traversed
+  void updateStackSize();
+
+  // _nodes4q from _nodes4; false (and _nodes4 kept) when a leaf does not
+  // fit the packed child reference: more than 8 triangles, which only
+  // flat leaves of coincident centroids reach
+  bool quantize4();
+  static void decode4(const Node4Q& q, Node4& out);
+
+  bool wide() const { return !_nodes4.empty() || !_nodes4q.empty(); }
+
+  // wide node i, decoded into scratch for the quantized layout
+  const Node4& node4At(int i, Node4& scratch) const {
+    if(_nodes4q.empty()) return _nodes4[i];
+    decode4(_nodes4q[i], scratch);
+    return scratch;
+  }
+
+  bool intersect2(const RTRay& ray, RTHit& hit, float tMaxLimit) const;
+  bool intersect4(const RTRay& ray, RTHit& hit, float tMaxLimit) const;
+  bool intersectLeaf(const RTRay& ray, int first, int count, RTHit& hit, float& tMax) const;
+
+  bool occluded2(const RTRay& ray, float tMax) const;
+  bool occluded4(const RTRay& ray, float tMax) const;
+  bool occludedLeaf(const RTRay& ray, int first, int count, float tMax) const;
+};
+
+// Slab test against the near/far planes picked by the ray direction signs.
+// tEntry is clamped to the ray start, the far side to tMax.
+inline bool BVH::intersectAABB(const RTRay& ray, const Node& node, float tMax, float& tEntry)
+{
+  const glm::vec3& lo = node.bmin;
+  const glm::vec3& hi = node.bmax;
+
+  float tx0 = ((ray.sign[0] ? hi.x : lo.x) - ray.o.x) * ray.invD.x;
+  float tx1 = ((ray.sign[0] ? lo.x : hi.x) - ray.o.x) * ray.invD.x;
+  float ty0 = ((ray.sign[1] ? hi.y : lo.y) - ray.o.y) * ray.invD.y;
+  float ty1 = ((ray.sign[1] ? lo.y : hi.y) - ray.o.y) * ray.invD.y;
+  float tz0 = ((ray.sign[2] ? hi.z : lo.z) - ray.o.z) * ray.invD.z;
+  float tz1 = ((ray.sign[2] ? lo.z : hi.z) - ray.o.z) * ray.invD.z;
+
+  float t0 = std::max(std::max(tx0, ty0), std::max(tz0, 0.f));
+  float t1 = std::min(std::min(tx1, ty1), std::min(tz1, tMax));
+
+  tEntry = t0;
+  return t0 <= t1;
+}
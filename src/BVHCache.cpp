@@ -0,0 +1,268 @@
+#include "BVH.h"
+
+#include <cstdio>
+#include <cstring>
+#include <fstream>
+#include <limits>
+#include <vector>
+
+#ifdef _WIN32
+#include <iterator>
+#else
+#include <fcntl.h>
+#include <sys/mman.h>
+#include <sys/stat.h>
+#include <unistd.h>
+#endif
+
+// BVH cache file: a fixed header, then the node arrays and the triangle
+// order, each starting on a 64-byte boundary. Native byte order; the
+// header records the struct sizes so a file from another build is
+// rejected rather than misread.
+
+namespace {
+
+const char BVH_FILE_MAGIC[8] = { 'R', 'T', 'B', 'V', 'H', 0, 0, 0 };
+const uint32_t BVH_FILE_VERSION = 1;
+
+struct BVHFileHeader {
+  char magic[8];
+  uint32_t version;
+  uint32_t nodeSize;
+  uint32_t node4Size;
+  uint32_t buildMode;
+  uint32_t layout;
+  uint32_t triCount;
+  uint64_t contentHash;
+  uint32_t nodeCount;
+  uint32_t node4Count;
+  uint64_t nodesOffset;
+  uint64_t nodes4Offset;
+  uint64_t primOffset;
+  uint64_t fileSize;
+  float builtCost;
+  uint32_t pad[3];
+};
+static_assert(sizeof(BVHFileHeader) % 16 == 0, "keep the header size fixed");
+
+uint64_t align64(uint64_t x) { return (x + 63) & ~uint64_t(63); }
+
+// Read-only view of a whole file: mmap where available, a plain read
+// otherwise. Only the read path of load(): the tree is validated in place
+// and copied out, the mapping is closed when load() returns.
+class MappedFile {
+public:
+  ~MappedFile() { close(); }
+
+  bool open(const std::string& path) {
+#ifdef _WIN32
+    std::ifstream in(path, std::ios::binary);
+    if(!in) return false;
+    _buffer.assign(std::istreambuf_iterator<char>(in), std::istreambuf_iterator<char>());
+    _data = _buffer.data();
+    _size = _buffer.size();
+    return true;
+#else
+    int fd = ::open(path.c_str(), O_RDONLY);
+    if(fd < 0) return false;
+    struct stat st;
+    if(fstat(fd, &st) != 0 || st.st_size <= 0) {
+      ::close(fd);
+      return false;
+    }
+    void* p = mmap(nullptr, (size_t)st.st_size, PROT_READ, MAP_PRIVATE, fd, 0);
+    ::close(fd);
+    if(p == MAP_FAILED) return false;
+    _data = (const char*)p;
+    _size = (size_t)st.st_size;
+    return true;
+#endif
+  }
+
+  void close() {
+#ifndef _WIN32
+    if(_data) munmap((void*)_data, _size);
+#endif
+    _data = nullptr;
+    _size = 0;
+  }
+
+  const char* data() const { return _data; }
+  size_t size() const { return _size; }
+
+private:
+  const char* _data = nullptr;
+  size_t _size = 0;
+#ifdef _WIN32
+  std::vector<char> _buffer;
+#endif
+};
+
+} // namespace
+
+// FNV-1a over the 32-bit words of the positions, plus the count
+uint64_t BVH::contentHash(const RTGeometry& tris) {
+  uint64_t h = 1469598103934665603ull;
+  auto mix = [&](uint32_t w) { h = (h ^ w) * 1099511628211ull; };
+
+  mix((uint32_t)tris.size());
+  for(size_t i = 0; i < tris.size(); ++i) {
+    const float* p[3] = { &tris.p(i, 0).x, &tris.p(i, 1).x, &tris.p(i, 2).x };
+    for(int v = 0; v < 3; ++v)
+      for(int a = 0; a < 3; ++a) {
+        uint32_t w;
+        std::memcpy(&w, p[v] + a, sizeof(w));
+        mix(w);
+      }
+  }
+  return h;
+}
+
+bool BVH::save(const std::string& path, uint64_t hash) const {
+  if(_nodes.empty()) return false;
+
+  BVHFileHeader hdr;
+  std::memset(&hdr, 0, sizeof(hdr));
+  std::memcpy(hdr.magic, BVH_FILE_MAGIC, sizeof(hdr.magic));
+  hdr.version = BVH_FILE_VERSION;
+  hdr.nodeSize = sizeof(Node);
+  hdr.node4Size = sizeof(Node4);
+  hdr.buildMode = (uint32_t)_buildMode;
+  hdr.layout = (uint32_t)_layout;
+  hdr.triCount = (uint32_t)_triCount;
+  hdr.contentHash = hash;
+  hdr.nodeCount = (uint32_t)_nodes.size();
+  hdr.node4Count = (uint32_t)_nodes4.size();
+  hdr.nodesOffset = align64(sizeof(hdr));
+  hdr.nodes4Offset = align64(hdr.nodesOffset + _nodes.size() * sizeof(Node));
+  hdr.primOffset = align64(hdr.nodes4Offset + _nodes4.size() * sizeof(Node4));
+  hdr.fileSize = hdr.primOffset + _primIndices.size() * sizeof(int);
+  hdr.builtCost = _builtCost;
+
+  std::string tmp = path + ".tmp";
+  {
+    std::ofstream out(tmp, std::ios::binary | std::ios::trunc);
+    if(!out) return false;
+
+    const char zeros[64] = {};
+    auto block = [&](uint64_t offset, const void* data, size_t bytes) {
+      uint64_t at = (uint64_t)out.tellp();
+      out.write(zeros, (std::streamsize)(offset - at));
+      out.write((const char*)data, (std::streamsize)bytes);
+    };
+    out.write((const char*)&hdr, sizeof(hdr));
+    block(hdr.nodesOffset, _nodes.data(), _nodes.size() * sizeof(Node));
+    block(hdr.nodes4Offset, _nodes4.data(), _nodes4.size() * sizeof(Node4));
+    block(hdr.primOffset, _primIndices.data(), _primIndices.size() * sizeof(int));
+
+    if(!out) {
+      out.close();
+      std::remove(tmp.c_str());
+      return false;
+    }
+  }
+
+  // replace the old file in one step (rename does not replace on Windows)
+#ifdef _WIN32
+  std::remove(path.c_str());
+#endif
+  if(std::rename(tmp.c_str(), path.c_str()) != 0) {
+    std::remove(tmp.c_str());
+    return false;
+  }
+  return true;
+}
+
+bool BVH::load(const std::string& path, const RTGeometry& tris, uint64_t hash,
+               BVHBuildMode mode, BVHLayout layout, ThreadPool* pool) {
+  if(tris.empty()) return false;
+
+  MappedFile file;
+  if(!file.open(path) || file.size() < sizeof(BVHFileHeader)) return false;
+
+  BVHFileHeader hdr;
+  std::memcpy(&hdr, file.data(), sizeof(hdr));
+  if(std::memcmp(hdr.magic, BVH_FILE_MAGIC, sizeof(hdr.magic)) != 0 ||
+     hdr.version != BVH_FILE_VERSION ||
+     hdr.nodeSize != sizeof(Node) || hdr.node4Size != sizeof(Node4) ||
+     hdr.buildMode != (uint32_t)mode || hdr.layout != (uint32_t)layout ||
+     hdr.triCount != tris.size() || hdr.contentHash != hash ||
+     hdr.fileSize != file.size() || hdr.nodeCount == 0)
+    return false;
+
+  if(hdr.nodesOffset + (uint64_t)hdr.nodeCount * sizeof(Node) > hdr.nodes4Offset ||
+     hdr.nodes4Offset + (uint64_t)hdr.node4Count * sizeof(Node4) > hdr.primOffset ||
+     hdr.primOffset + (uint64_t)hdr.triCount * sizeof(int) != hdr.fileSize)
+    return false;
+
+  const int* prims = (const int*)(file.data() + hdr.primOffset);
+  for(uint32_t i = 0; i < hdr.triCount; ++i)
+    if(prims[i] < 0 || prims[i] >= (int)hdr.triCount) return false;
+
+  // Leaves inside the triangle range, children after their parent, every
+  // node but the root referenced exactly once (so the nodes form a single
+  // tree) and no deeper than the traversal stacks hold: a damaged file
+  // cannot send a traversal out of bounds, into a loop or past its stack.
+  const Node* nodes = (const Node*)(file.data() + hdr.nodesOffset);
+  std::vector<int> refs(hdr.nodeCount, 0), depth(hdr.nodeCount, 0);
+  for(uint32_t i = 0; i < hdr.nodeCount; ++i) {
+    const Node& n = nodes[i];
+    if(i > 0 && refs[i] != 1) return false;
+    if(depth[i] + 1 > TRAVERSAL_STACK) return false;
+    if(n.count > 0) {
+      if(n.rightOrFirst < 0 || (uint64_t)n.rightOrFirst + n.count > hdr.triCount) return false;
+      continue;
+    }
+    if(n.count != 0 || i + 1 >= hdr.nodeCount || n.rightOrFirst <= (int)i + 1 ||
+       (uint32_t)n.rightOrFirst >= hdr.nodeCount)
+      return false;
+    int children[2] = { (int)i + 1, n.rightOrFirst };
+    for(int c : children) {
+      refs[c]++;
+      depth[c] = depth[i] + 1;
+    }
+  }
+
+  // the same for the wide nodes; an unused slot (no count, child 0) must
+  // have the empty box collapse4() gives it, or a traversal would enter
+  // the root again
+  const float inf = std::numeric_limits<float>::infinity();
+  const Node4* nodes4 = (const Node4*)(file.data() + hdr.nodes4Offset);
+  std::vector<int> refs4(hdr.node4Count, 0), depth4(hdr.node4Count, 0);
+  for(uint32_t i = 0; i < hdr.node4Count; ++i) {
+    const Node4& n = nodes4[i];
+    if(i > 0 && refs4[i] != 1) return false;
+    if(3 * depth4[i] + 1 > TRAVERSAL_STACK) return false;
+    for(int c = 0; c < 4; ++c) {
+      int child = n.child[c], count = n.count[c];
+      if(count > 0) {
+        if(child < 0 || (uint64_t)child + count > hdr.triCount) return false;
+      } else if(count != 0) {
+        return false;
+      } else if(child == 0) {
+        bool empty = n.bminX[c] == inf && n.bminY[c] == inf && n.bminZ[c] == inf &&
+                     n.bmaxX[c] == -inf && n.bmaxY[c] == -inf && n.bmaxZ[c] == -inf;
+        if(!empty) return false;
+      } else {
+        if(child <= (int)i || (uint32_t)child >= hdr.node4Count) return false;
+        refs4[child]++;
+        depth4[child] = depth4[i] + 1;
+      }
+    }
+  }
+
+  // copied, not kept mapped: refit() and buildWide() write these arrays,
+  // and the copy is a single pass over memory the validation just read
+  _buildMode = mode;
+  _layout = layout;
+  _builtCost = hdr.builtCost;
+  _nodes.assign(nodes, nodes + hdr.nodeCount);
+  _nodes4.assign(nodes4, nodes4 + hdr.node4Count);
+  _nodes4q.clear();
+  _primIndices.assign(prims, prims + hdr.triCount);
+  gatherTris(tris, pool);
+  // quantized nodes are not stored, they come from the binary ones
+  if(layout == BVHLayout::Wide4Quantized) buildWide();
+  else updateStackSize();
+  return true;
+}
@@ -0,0 +1,330 @@
+#include "BVH.h"
+#include "Morton.h"
+#include "ThreadPool.h"
+
+#include <algorithm>
+#include <cstdint>
+#include <functional>
+#include <limits>
+#include <mutex>
+
+#ifdef _MSC_VER
+#include <intrin.h>
+#endif
+
+// Linear BVH: the primitives are sorted along a Morton curve through their
+// centroids and the binary radix tree over the sorted codes (Karras 2012) is
+// the hierarchy. Every internal node finds its own range and children from
+// the codes alone, so the whole tree is emitted in one parallel pass. The
+// optional treelet pass (Karras & Aila 2013) then restructures the tree
+// bottom-up, treelet by treelet, for a lower SAH cost.
+
+namespace {
+
+const float C_TRAV = 1.0f;
+const float C_ISECT = 1.0f;
+const int TREELET_LEAVES = 7;
+
+int clz32(uint32_t x) {
+#ifdef _MSC_VER
+  unsigned long i;
+  _BitScanReverse(&i, x);
+  return 31 - (int)i;
+#else
+  return __builtin_clz(x);
+#endif
+}
+
+// Binary radix tree over n sorted codes. Nodes [0, n-1) are internal (the
+// root is 0), node n-1+k is the leaf of the k-th sorted primitive.
+struct RadixTree {
+  int n = 0;
+  int maxLeaf = 0;
+  std::vector<uint32_t> codes;
+  std::vector<int> prims;        // sorted primitive of each leaf
+  std::vector<int> left, right;  // per internal node
+  std::vector<int> count;        // primitives below each node
+  std::vector<RTAABB> box;
+  std::vector<float> cost;       // SAH cost of the subtree, not normalized
+  std::vector<char> collapse;    // internal node emitted as a single leaf
+
+  bool isLeaf(int node) const { return node >= n - 1; }
+
+  // length of the common prefix of codes i and j, ties broken by index
+  int delta(int i, int j) const {
+    if(j < 0 || j >= n) return -1;
+    uint32_t x = codes[i] ^ codes[j];
+    return x ? clz32(x) : 32 + clz32((uint32_t)(i ^ j));
+  }
+
+  // Finds the key range of internal node i and where it splits
+  void buildInternal(int i) {
+    int d = delta(i, i + 1) > delta(i, i - 1) ? 1 : -1;
+
+    // the other end j of the range, by exponential then binary search
+    int dMin = delta(i, i - d);
+    int lMax = 2;
+    while(delta(i, i + lMax * d) > dMin) lMax *= 2;
+    int l = 0;
+    for(int t = lMax / 2; t >= 1; t /= 2)
+      if(delta(i, i + (l + t) * d) > dMin) l += t;
+    int j = i + l * d;
+
+    // the split is after the last key sharing more than the range's prefix
+    int dNode = delta(i, j);
+    int s = 0;
+    int t = l;
+    do {
+      t = (t + 1) / 2;
+      if(delta(i, i + (s + t) * d) > dNode) s += t;
+    } while(t > 1);
+    int gamma = i + s * d + std::min(d, 0);
+
+    int first = std::min(i, j), last = std::max(i, j);
+    left[i]  = first == gamma ? n - 1 + gamma : gamma;
+    right[i] = last == gamma + 1 ? n - 1 + gamma + 1 : gamma + 1;
+    count[i] = last - first + 1;
+  }
+
+  // bounds and cost of internal node i from its children; small subtrees
+  // become a leaf when that is cheaper
+  void finalize(int i) {
+    int l = left[i], r = right[i];
+    box[i] = BVH::mergeAABB(box[l], box[r]);
+    count[i] = count[l] + count[r];
+
+    float area = BVH::surfaceArea(box[i]);
+    float split = C_TRAV * area + cost[l] + cost[r];
+    float leaf = C_ISECT * area * count[i];
+    collapse[i] = count[i] <= maxLeaf && leaf <= split;
+    cost[i] = collapse[i] ? leaf : split;
+  }
+
+  // Post-order finalize (and treelet pass) of the subtree below node
+  void visit(int node, bool optimize) {
+    if(isLeaf(node)) return;
+    visit(left[node], optimize);
+    visit(right[node], optimize);
+    finalize(node);
+    if(optimize && count[node] >= TREELET_LEAVES) optimizeTreelet(node);
+  }
+
+  // Grows the treelet below root to TREELET_LEAVES leaves by opening the
+  // largest one, finds the cheapest binary tree over those leaves by
+  // dynamic programming over their subsets and rebuilds the treelet with it
+  // when it is cheaper, reusing the same internal nodes.
+  void optimizeTreelet(int root) {
+    int leaves[TREELET_LEAVES];
+    int internals[TREELET_LEAVES - 1];
+    int nl = 2, ni = 1;
+    leaves[0] = left[root];
+    leaves[1] = right[root];
+    internals[0] = root;
+
+    while(nl < TREELET_LEAVES) {
+      int best = -1;
+      float bestArea = -1.f;
+      for(int k = 0; k < nl; ++k) {
+        if(isLeaf(leaves[k])) continue;
+        float a = BVH::surfaceArea(box[leaves[k]]);
+        if(a > bestArea) { bestArea = a; best = k; }
+      }
+      if(best < 0) break;
+
+      int node = leaves[best];
+      internals[ni++] = node;
+      leaves[best] = left[node];
+      leaves[nl++] = right[node];
+    }
+    if(nl < 3) return;
+
+    const int SUBSETS = 1 << TREELET_LEAVES;
+    glm::vec3 sMin[SUBSETS], sMax[SUBSETS];
+    float sArea[SUBSETS], sCost[SUBSETS];
+    int sCount[SUBSETS];
+    int sPart[SUBSETS];
+
+    int full = (1 << nl) - 1;
+    for(int s = 1; s <= full; ++s) {
+      int low = s & -s;
+      int k = 0;
+      while(!(low & (1 << k))) ++k;
+      int rest = s ^ low;
+
+      const RTAABB& lb = box[leaves[k]];
+      sMin[s] = rest ? glm::min(sMin[rest], lb.bmin) : lb.bmin;
+      sMax[s] = rest ? glm::max(sMax[rest], lb.bmax) : lb.bmax;
+      sCount[s] = (rest ? sCount[rest] : 0) + count[leaves[k]];
+      glm::vec3 e = sMax[s] - sMin[s];
+      sArea[s] = 2.f * (e.x*e.y + e.y*e.z + e.z*e.x);
+
+      if(!rest) {
+        sCost[s] = cost[leaves[k]];
+        sPart[s] = 0;
+        continue;
+      }
+
+      // every split of s into two non-empty halves, enumerated once as
+      // the lowest leaf plus a proper subset q of the others
+      float best = std::numeric_limits<float>::infinity();
+      int bestPart = 0;
+      for(int q = (rest - 1) & rest; ; q = (q - 1) & rest) {
+        int p = q | low;
+        float c = sCost[p] + sCost[s ^ p];
+        if(c < best) { best = c; bestPart = p; }
+        if(!q) break;
+      }
+
+      float split = C_TRAV * sArea[s] + best;
+      float leaf = C_ISECT * sArea[s] * sCount[s];
+      sCost[s] = sCount[s] <= maxLeaf && leaf <= split ? leaf : split;
+      sPart[s] = bestPart;
+    }
+
+    if(sCost[full] >= cost[root] * (1.f - 1e-5f)) return;
+
+    int nextInternal = 1;
+    rebuildTreelet(root, full, leaves, internals, nextInternal, sPart);
+  }
+
+  void rebuildTreelet(int node, int s, const int* leaves, const int* internals, int& nextInternal, const int* sPart) {
+    int halves[2] = { sPart[s], s ^ sPart[s] };
+    int children[2];
+    for(int h = 0; h < 2; ++h) {
+      if(!(halves[h] & (halves[h] - 1))) {
+        int k = 0;
+        while(!(halves[h] & (1 << k))) ++k;
+        children[h] = leaves[k];
+      } else {
+        children[h] = internals[nextInternal++];
+        rebuildTreelet(children[h], halves[h], leaves, internals, nextInternal, sPart);
+      }
+    }
+    left[node] = children[0];
+    right[node] = children[1];
+    finalize(node);
+  }
+};
+
+} // namespace
+
+void BVH::buildLBVH(const BuildInput& in, ThreadPool* pool, bool optimizeTreelets) {
+  int n = (int)in.boxes.size();
+  if(pool && pool->size() <= 1) pool = nullptr;
+
+  // centroid bounds, then 30-bit Morton codes in that box
+  RTAABB cb;
+  std::mutex m;
+  parallelChunks(pool, n, PARALLEL_BUILD_MIN, [&](int begin, int end) {
+    RTAABB local;
+    for(int i = begin; i < end; ++i) {
+      local.bmin = glm::min(local.bmin, in.centroids[i]);
+      local.bmax = glm::max(local.bmax, in.centroids[i]);
+    }
+    std::lock_guard<std::mutex> lk(m);
+    cb = mergeAABB(cb, local);
+  });
+
+  glm::vec3 ext = cb.bmax - cb.bmin;
+  glm::vec3 scale(ext.x > 0.f ? 1024.f / ext.x : 0.f,
+                  ext.y > 0.f ? 1024.f / ext.y : 0.f,
+                  ext.z > 0.f ? 1024.f / ext.z : 0.f);
+
+  RadixTree tree;
+  tree.n = n;
+  tree.maxLeaf = MAX_LEAF_TRI_COUNT;
+  tree.codes.resize(n);
+  tree.prims.resize(n);
+  parallelChunks(pool, n, PARALLEL_BUILD_MIN, [&](int begin, int end) {
+    for(int i = begin; i < end; ++i) {
+      glm::vec3 q = (in.centroids[i] - cb.bmin) * scale;
+      uint32_t x = (uint32_t)std::min(1023.f, std::max(0.f, q.x));
+      uint32_t y = (uint32_t)std::min(1023.f, std::max(0.f, q.y));
+      uint32_t z = (uint32_t)std::min(1023.f, std::max(0.f, q.z));
+      tree.codes[i] = morton3D(x, y, z);
+      tree.prims[i] = i;
+    }
+  });
+
+  radixSortPairs(tree.codes, tree.prims, pool, PARALLEL_BUILD_MIN);
+
+  int nodeCount = 2 * n - 1;
+  tree.left.resize(n - 1);
+  tree.right.resize(n - 1);
+  tree.count.resize(nodeCount);
+  tree.box.resize(nodeCount);
+  tree.cost.resize(nodeCount);
+  tree.collapse.assign(n - 1, 0);
+
+  parallelChunks(pool, n, PARALLEL_BUILD_MIN, [&](int begin, int end) {
+    for(int k = begin; k < end; ++k) {
+      int leaf = n - 1 + k;
+      tree.box[leaf] = in.boxes[tree.prims[k]];
+      tree.count[leaf] = 1;
+      tree.cost[leaf] = C_ISECT * surfaceArea(tree.box[leaf]);
+      if(k < n - 1) tree.buildInternal(k);
+    }
+  });
+
+  // Bottom-up pass: subtrees below subtreeMax primitives are independent
+  // tasks, the few nodes above them are finished afterwards
+  int root = n > 1 ? 0 : n - 1;
+  int subtreeMax = pool ? std::max(PARALLEL_BUILD_MIN / 4, n / (pool->size() * 8)) : n;
+  std::vector<int> subtreeRoots;
+  std::vector<char> isSubtreeRoot(nodeCount, 0);
+  std::function<void(int)> collect = [&](int node) {
+    if(tree.isLeaf(node) || tree.count[node] <= subtreeMax) {
+      subtreeRoots.push_back(node);
+      isSubtreeRoot[node] = 1;
+      return;
+    }
+    collect(tree.left[node]);
+    collect(tree.right[node]);
+  };
+  collect(root);
+
+  forChunks(pool, (int)subtreeRoots.size(), [&](int k) {
+    tree.visit(subtreeRoots[k], optimizeTreelets);
+  });
+
+  std::function<void(int)> visitTop = [&](int node) {
+    if(isSubtreeRoot[node]) return;
+    visitTop(tree.left[node]);
+    visitTop(tree.right[node]);
+    tree.finalize(node);
+    if(optimizeTreelets && tree.count[node] >= TREELET_LEAVES) tree.optimizeTreelet(node);
+  };
+  visitTop(root);
+
+  // depth-first layout; collapsed subtrees become leaves whose primitives
+  // are stored contiguously
+  std::vector<int> order;
+  order.reserve(n);
+  std::function<void(int)> gather = [&](int node) {
+    if(tree.isLeaf(node)) order.push_back(tree.prims[node - (n - 1)]);
+    else { gather(tree.left[node]); gather(tree.right[node]); }
+  };
+  std::function<int(int)> emit = [&](int node) {
+    int nodeIdx = (int)_nodes.size();
+    _nodes.push_back(Node());
+    _nodes[nodeIdx].bmin = tree.box[node].bmin;
+    _nodes[nodeIdx].bmax = tree.box[node].bmax;
+
+    if(tree.isLeaf(node) || tree.collapse[node]) {
+      int first = (int)order.size();
+      gather(node);
+      _nodes[nodeIdx].rightOrFirst = first;
+      _nodes[nodeIdx].count = (int)order.size() - first;
+      return nodeIdx;
+    }
+
+    emit(tree.left[node]);
+    int right = emit(tree.right[node]);
+    _nodes[nodeIdx].rightOrFirst = right;
+    _nodes[nodeIdx].count = 0;
+    return nodeIdx;
+  };
+  emit(root);
+
+  _primIndices.swap(order);
+}
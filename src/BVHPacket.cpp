@@ -0,0 +1,218 @@
+#include "BVH.h"
+
+#include <algorithm>
+#include <cassert>
+#include <cmath>
+
+#if defined(__SSE2__) || defined(_M_X64) || (defined(_M_IX86_FP) && _M_IX86_FP >= 2)
+#define RT_USE_SSE 1
+#include <xmmintrin.h>
+#endif
+
+// Packet traversal of the BVH4: the packet walks the tree once, every node
+// is fetched once for all its rays. A child is culled for the whole packet
+// when an interval arithmetic slab test over the packet's origins and
+// inverse directions proves no ray can hit it; otherwise the rays are
+// tested one by one from the first still active one, and the child is
+// entered with the first ray that hits it (the rays before it missed its
+// box, so they stay out of the subtree).
+
+namespace {
+
+// Bounds of the packet's origins and inverse directions. All rays share
+// their direction signs, so the near and far planes of a box are the same
+// for all of them.
+struct PacketBounds {
+  glm::vec3 omin, omax;
+  glm::vec3 imin, imax;
+  int sign[3];
+};
+
+// Bounds of (b - o) * invD over the packet for a plane b: the product of
+// the intervals [b - omax, b - omin] and [imin, imax]. Float subtraction
+// and multiplication round monotonically, so every ray's own value lies
+// inside.
+#ifdef RT_USE_SSE
+inline void slabInterval(__m128 b, __m128 omin, __m128 omax, __m128 imin, __m128 imax, __m128& lo, __m128& hi) {
+  __m128 a0 = _mm_sub_ps(b, omax), a1 = _mm_sub_ps(b, omin);
+  __m128 p0 = _mm_mul_ps(a0, imin), p1 = _mm_mul_ps(a0, imax);
+  __m128 p2 = _mm_mul_ps(a1, imin), p3 = _mm_mul_ps(a1, imax);
+  lo = _mm_min_ps(_mm_min_ps(p0, p1), _mm_min_ps(p2, p3));
+  hi = _mm_max_ps(_mm_max_ps(p0, p1), _mm_max_ps(p2, p3));
+}
+#else
+inline void slabInterval(float b, float omin, float omax, float imin, float imax, float& lo, float& hi) {
+  float a0 = b - omax, a1 = b - omin;
+  float p0 = a0 * imin, p1 = a0 * imax, p2 = a1 * imin, p3 = a1 * imax;
+  lo = std::min(std::min(p0, p1), std::min(p2, p3));
+  hi = std::max(std::max(p0, p1), std::max(p2, p3));
+}
+#endif
+
+// Conservative packet test against the four boxes of a node: a cleared bit
+// means no ray of the packet enters that child before tMax. tNear receives
+// a lower bound of every ray's entry distance.
+int cullAABB4(const PacketBounds& pb, const BVH::Node4& node, float tMax, float tNear[4]) {
+  const float* nearX = pb.sign[0] ? node.bmaxX : node.bminX;
+  const float* farX  = pb.sign[0] ? node.bminX : node.bmaxX;
+  const float* nearY = pb.sign[1] ? node.bmaxY : node.bminY;
+  const float* farY  = pb.sign[1] ? node.bminY : node.bmaxY;
+  const float* nearZ = pb.sign[2] ? node.bmaxZ : node.bminZ;
+  const float* farZ  = pb.sign[2] ? node.bminZ : node.bmaxZ;
+
+#ifdef RT_USE_SSE
+  __m128 nxLo, nxHi, nyLo, nyHi, nzLo, nzHi, fxLo, fxHi, fyLo, fyHi, fzLo, fzHi;
+  const __m128 ominX = _mm_set1_ps(pb.omin.x), omaxX = _mm_set1_ps(pb.omax.x);
+  const __m128 ominY = _mm_set1_ps(pb.omin.y), omaxY = _mm_set1_ps(pb.omax.y);
+  const __m128 ominZ = _mm_set1_ps(pb.omin.z), omaxZ = _mm_set1_ps(pb.omax.z);
+  const __m128 iminX = _mm_set1_ps(pb.imin.x), imaxX = _mm_set1_ps(pb.imax.x);
+  const __m128 iminY = _mm_set1_ps(pb.imin.y), imaxY = _mm_set1_ps(pb.imax.y);
+  const __m128 iminZ = _mm_set1_ps(pb.imin.z), imaxZ = _mm_set1_ps(pb.imax.z);
+  slabInterval(_mm_load_ps(nearX), ominX, omaxX, iminX, imaxX, nxLo, nxHi);
+  slabInterval(_mm_load_ps(nearY), ominY, omaxY, iminY, imaxY, nyLo, nyHi);
+  slabInterval(_mm_load_ps(nearZ), ominZ, omaxZ, iminZ, imaxZ, nzLo, nzHi);
+  slabInterval(_mm_load_ps(farX), ominX, omaxX, iminX, imaxX, fxLo, fxHi);
+  slabInterval(_mm_load_ps(farY), ominY, omaxY, iminY, imaxY, fyLo, fyHi);
+  slabInterval(_mm_load_ps(farZ), ominZ, omaxZ, iminZ, imaxZ, fzLo, fzHi);
+
+  __m128 t0 = _mm_max_ps(_mm_max_ps(nxLo, nyLo), _mm_max_ps(nzLo, _mm_setzero_ps()));
+  __m128 t1 = _mm_min_ps(_mm_min_ps(fxHi, fyHi), _mm_min_ps(fzHi, _mm_set1_ps(tMax)));
+  _mm_storeu_ps(tNear, t0);
+  return _mm_movemask_ps(_mm_cmple_ps(t0, t1));
+#else
+  int mask = 0;
+  for(int c=0; c<4; ++c) {
+    float nxLo, nxHi, nyLo, nyHi, nzLo, nzHi, fxLo, fxHi, fyLo, fyHi, fzLo, fzHi;
+    slabInterval(nearX[c], pb.omin.x, pb.omax.x, pb.imin.x, pb.imax.x, nxLo, nxHi);
+    slabInterval(nearY[c], pb.omin.y, pb.omax.y, pb.imin.y, pb.imax.y, nyLo, nyHi);
+    slabInterval(nearZ[c], pb.omin.z, pb.omax.z, pb.imin.z, pb.imax.z, nzLo, nzHi);
+    slabInterval(farX[c], pb.omin.x, pb.omax.x, pb.imin.x, pb.imax.x, fxLo, fxHi);
+    slabInterval(farY[c], pb.omin.y, pb.omax.y, pb.imin.y, pb.imax.y, fyLo, fyHi);
+    slabInterval(farZ[c], pb.omin.z, pb.omax.z, pb.imin.z, pb.imax.z, fzLo, fzHi);
+    float t0 = std::max(std::max(nxLo, nyLo), std::max(nzLo, 0.f));
+    float t1 = std::min(std::min(fxHi, fyHi), std::min(fzHi, tMax));
+    tNear[c] = t0;
+    if(t0 <= t1) mask |= 1 << c;
+  }
+  return mask;
+#endif
+}
+
+} // namespace
+
+bool BVH::packetCoherent(const RTRay* rays, int count) {
+  for(int r=1; r<count; ++r)
+    for(int a=0; a<3; ++a)
+      if(rays[r].sign[a] != rays[0].sign[a]) return false;
+  return true;
+}
+
+uint32_t BVH::intersectPacket(const RTRay* rays, int count, RTHit* hits, float tMaxLimit) const
+{
+  assert(count <= MAX_PACKET);
+  uint32_t updated = 0;
+  if(count <= 0) return 0;
+
+  if(!wide() || !packetCoherent(rays, count)) {
+    for(int r=0; r<count; ++r)
+      if(intersect(rays[r], hits[r], tMaxLimit)) updated |= 1u << r;
+    return updated;
+  }
+
+  RTStats& st = rtThreadStats();
+
+  float tMax[MAX_PACKET];
+  PacketBounds pb;
+  pb.omin = pb.omax = rays[0].o;
+  pb.imin = pb.imax = rays[0].invD;
+  for(int a=0; a<3; ++a) pb.sign[a] = rays[0].sign[a];
+  for(int r=0; r<count; ++r) {
+    tMax[r] = std::min(hits[r].t, tMaxLimit);
+    pb.omin = glm::min(pb.omin, rays[r].o);
+    pb.omax = glm::max(pb.omax, rays[r].o);
+    pb.imin = glm::min(pb.imin, rays[r].invD);
+    pb.imax = glm::max(pb.imax, rays[r].invD);
+  }
+
+  // as intersect4(), plus the first ray still active below the entry;
+  // tEntry is the packet's lower bound of the entry distance
+  struct StackEntry {
+    int ref;
+    int count;
+    int first;
+    float tEntry;
+  };
+  TraversalStack<StackEntry> stack(_stackSize);
+  int sp = 0;
+  stack[sp].ref = 0;
+  stack[sp].count = 0;
+  stack[sp].first = 0;
+  stack[sp].tEntry = 0.f;
+  ++sp;
+
+  while(sp) {
+    const StackEntry e = stack[--sp];
+
+    float packetTMax = 0.f;
+    for(int r=e.first; r<count; ++r) packetTMax = std::max(packetTMax, tMax[r]);
+    if(e.tEntry > packetTMax) continue;
+
+    st.nodesVisited += count - e.first;
+
+    if(e.count > 0) {
+      st.triTests += (unsigned long long)e.count * (count - e.first);
+      for(int r=e.first; r<count; ++r)
+        if(intersectLeaf(rays[r], e.ref, e.count, hits[r], tMax[r])) updated |= 1u << r;
+      continue;
+    }
+
+    Node4 scratch;
+    const Node4& node = node4At(e.ref, scratch);
+
+    alignas(16) float tCull[4];
+    int pending = cullAABB4(pb, node, packetTMax, tCull);
+    if(!pending) continue;
+
+    // first ray entering each child, and its entry distance to order them
+    int first[4];
+    float tOrder[4];
+    int mask = 0;
+    for(int r=e.first; r<count && pending; ++r) {
+      alignas(16) float tNear[4];
+      int hit = intersectAABB4(rays[r], node, tMax[r], tNear) & pending;
+      st.boxTests += 4;
+      for(int c=0; c<4; ++c) {
+        if(!(hit & (1 << c))) continue;
+        first[c] = r;
+        tOrder[c] = tNear[c];
+      }
+      mask |= hit;
+      pending &= ~hit;
+    }
+    if(!mask) continue;
+
+    // far to near, so the nearest is popped first
+    int order[4];
+    int n = 0;
+    for(int c=0; c<4; ++c) {
+      if(!(mask & (1 << c))) continue;
+      int k = n++;
+      while(k > 0 && tOrder[order[k-1]] < tOrder[c]) {
+        order[k] = order[k-1];
+        --k;
+      }
+      order[k] = c;
+    }
+
+    for(int k=0; k<n; ++k) {
+      int c = order[k];
+      stack[sp].ref = node.child[c];
+      stack[sp].count = node.count[c];
+      stack[sp].first = first[c];
+      stack[sp].tEntry = tCull[c];
+      ++sp;
+    }
+  }
+
+  return updated;
+}
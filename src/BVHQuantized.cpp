@@ -0,0 +1,151 @@
+#include "BVH.h"
+
+#include <algorithm>
+#include <cmath>
+#include <cstring>
+#include <limits>
+
+#if defined(__SSE2__) || defined(_M_X64) || (defined(_M_IX86_FP) && _M_IX86_FP >= 2)
+#define RT_USE_SSE 1
+#include <emmintrin.h>
+#endif
+
+// Quantized BVH4: every Node4 becomes a Node4Q of half its size. Per axis
+// the node keeps the origin (the low corner of its children's union) and a
+// power-of-two step; a child bound is origin + q * step with an 8-bit q.
+// q * step is exact, so the decoded bound is a single rounding of the sum,
+// and the build checks that very sum: a decoded box never shrinks below the
+// exact one, traversal only visits a few extra nodes.
+
+namespace {
+
+const int Q_MAX = 255;
+
+inline float decodeBound(float origin, float scale, int q) {
+  return origin + float(q) * scale;
+}
+
+// Smallest power of two with extent <= Q_MAX * step, and at least 2^-16 of
+// the origin's magnitude, so that origin + Q_MAX * step > origin and empty
+// slots (lo = Q_MAX, hi = 0) stay empty once decoded
+float stepFor(float extent, float origin) {
+  float want = std::max(extent / float(Q_MAX), std::max(std::fabs(origin), std::fabs(origin + extent)) * (1.f / 65536.f));
+  if(!(want > 0.f)) return std::ldexp(1.f, -64);
+  int e;
+  float m = std::frexp(want, &e); // want = m * 2^e, m in [0.5, 1)
+  return m == 0.5f ? std::ldexp(1.f, e - 1) : std::ldexp(1.f, e);
+}
+
+// Rounds [bmin, bmax] outwards to steps of scale from origin; false when
+// bmax is out of reach of Q_MAX steps
+bool quantizeRange(float origin, float scale, float bmin, float bmax, uint8_t& qlo, uint8_t& qhi) {
+  int lo = (int)std::floor((bmin - origin) / scale);
+  int hi = (int)std::ceil((bmax - origin) / scale);
+  lo = std::max(0, std::min(lo, Q_MAX));
+  hi = std::max(0, std::min(hi, Q_MAX));
+  while(lo > 0 && decodeBound(origin, scale, lo) > bmin) --lo;
+  while(hi < Q_MAX && decodeBound(origin, scale, hi) < bmax) ++hi;
+  if(decodeBound(origin, scale, lo) > bmin || decodeBound(origin, scale, hi) < bmax) return false;
+  qlo = (uint8_t)lo;
+  qhi = (uint8_t)hi;
+  return true;
+}
+
+} // namespace
+
+bool BVH::quantize4() {
+  _nodes4q.resize(_nodes4.size());
+
+  for(size_t i = 0; i < _nodes4.size(); ++i) {
+    const Node4& n = _nodes4[i];
+    Node4Q& q = _nodes4q[i];
+
+    const float* mins[3] = { n.bminX, n.bminY, n.bminZ };
+    const float* maxs[3] = { n.bmaxX, n.bmaxY, n.bmaxZ };
+
+    // used slots: internal children and leaves; the others have inverted
+    // bounds
+    int used = 0;
+    for(int c = 0; c < 4; ++c)
+      if(n.bminX[c] <= n.bmaxX[c]) used |= 1 << c;
+
+    for(int a = 0; a < 3; ++a) {
+      float lo = std::numeric_limits<float>::infinity(), hi = -lo;
+      for(int c = 0; c < 4; ++c) {
+        if(!(used & (1 << c))) continue;
+        lo = std::min(lo, mins[a][c]);
+        hi = std::max(hi, maxs[a][c]);
+      }
+
+      q.origin[a] = lo;
+      q.scale[a] = stepFor(hi - lo, lo);
+      for(;;) {
+        bool ok = true;
+        for(int c = 0; c < 4 && ok; ++c) {
+          if(used & (1 << c)) {
+            ok = quantizeRange(q.origin[a], q.scale[a], mins[a][c], maxs[a][c], q.qlo[a][c], q.qhi[a][c]);
+          } else {
+            q.qlo[a][c] = (uint8_t)Q_MAX;
+            q.qhi[a][c] = 0;
+          }
+        }
+        if(ok) break;
+        q.scale[a] *= 2.f;
+      }
+    }
+
+    for(int c = 0; c < 4; ++c) {
+      if(n.count[c] > 8 || n.child[c] > std::numeric_limits<int>::max() / 8 - 1) return false;
+      q.child[c] = n.count[c] > 0 ? Node4Q::leaf(n.child[c], n.count[c]) : n.child[c];
+    }
+  }
+  return true;
+}
+
+void BVH::decode4(const Node4Q& q, Node4& out) {
+  float* mins[3] = { out.bminX, out.bminY, out.bminZ };
+  float* maxs[3] = { out.bmaxX, out.bmaxY, out.bmaxZ };
+
+#ifdef RT_USE_SSE
+  const __m128i zero = _mm_setzero_si128();
+  for(int a = 0; a < 3; ++a) {
+    int lo, hi;
+    std::memcpy(&lo, q.qlo[a], 4);
+    std::memcpy(&hi, q.qhi[a], 4);
+    __m128 qlo = _mm_cvtepi32_ps(_mm_unpacklo_epi16(_mm_unpacklo_epi8(_mm_cvtsi32_si128(lo), zero), zero));
+    __m128 qhi = _mm_cvtepi32_ps(_mm_unpacklo_epi16(_mm_unpacklo_epi8(_mm_cvtsi32_si128(hi), zero), zero));
+    __m128 o = _mm_set1_ps(q.origin[a]), s = _mm_set1_ps(q.scale[a]);
+    _mm_store_ps(mins[a], _mm_add_ps(o, _mm_mul_ps(qlo, s)));
+    _mm_store_ps(maxs[a], _mm_add_ps(o, _mm_mul_ps(qhi, s)));
+  }
+#else
+  for(int a = 0; a < 3; ++a)
+    for(int c = 0; c < 4; ++c) {
+      mins[a][c] = decodeBound(q.origin[a], q.scale[a], q.qlo[a][c]);
+      maxs[a][c] = decodeBound(q.origin[a], q.scale[a], q.qhi[a][c]);
+    }
+#endif
+
+  for(int c = 0; c < 4; ++c) {
+    int ref = q.child[c];
+    if(ref < 0) {
+      int packed = -1 - ref;
+      out.child[c] = packed >> 3;
+      out.count[c] = (packed & 7) + 1;
+    } else {
+      out.child[c] = ref;
+      out.count[c] = 0;
+    }
+  }
+}
+
+size_t BVH::traversalBytes() const {
+  size_t nodes = wide() ? _nodes4.size() * sizeof(Node4) + _nodes4q.size() * sizeof(Node4Q)
+                        : _nodes.size() * sizeof(Node);
+  return nodes + _tris4.size() * sizeof(AccelTri4);
+}
+
+size_t BVH::memoryBytes() const {
+  return _nodes.size() * sizeof(Node) + _nodes4.size() * sizeof(Node4) + _nodes4q.size() * sizeof(Node4Q) +
+         _tris4.size() * sizeof(AccelTri4) + _primIndices.size() * sizeof(int);
+}
@@ -105,126 +105,13 @@ void Mesh::addPlan(float square_half_side)
     glm::uvec3(_vertexPositions.size()-4, _vertexPositions.size()-2, _vertexPositions.size()-1));
 }
 
-void Mesh::init()
-{
-  if (_vertexPositions.empty() || _triangleIndices.empty()) {
-    throw std::runtime_error("[Mesh::init] Empty mesh (no vertices or no triangles). Did you load the file correctly?");
-  }
-
-
-  glCreateBuffers(1, &_posVbo); // Generate a GPU buffer to store the positions of the vertices
-  size_t vertexBufferSize = sizeof(glm::vec3)*_vertexPositions.size(); // Gather the size of the buffer from the CPU-side vector
-  glNamedBufferStorage(_posVbo, vertexBufferSize, _vertexPositions.data(), GL_DYNAMIC_STORAGE_BIT); // Create a data store on the GPU
-
-  glCreateBuffers(1, &_normalVbo); // Same for normal
-  glNamedBufferStorage(_normalVbo, vertexBufferSize, _vertexNormals.data(), GL_DYNAMIC_STORAGE_BIT);
-
-  glCreateBuffers(1, &_texCoordVbo); // Same for texture coordinates
-  size_t texCoordBufferSize = sizeof(glm::vec2)*_vertexTexCoords.size();
-  glNamedBufferStorage(_texCoordVbo, texCoordBufferSize, _vertexTexCoords.data(), GL_DYNAMIC_STORAGE_BIT);
-
-  glCreateBuffers(1, &_ibo); // Same for the index buffer, that stores the list of indices of the triangles forming the mesh
-  size_t indexBufferSize = sizeof(glm::uvec3)*_triangleIndices.size();
-  glNamedBufferStorage(_ibo, indexBufferSize, _triangleIndices.data(), GL_DYNAMIC_STORAGE_BIT);
-
-  glCreateVertexArrays(1, &_vao); // Create a single handle that joins together attributes (vertex positions, normals) and connectivity (triangles indices)
-  glBindVertexArray(_vao);
-
-  glEnableVertexAttribArray(0);
-  glBindBuffer(GL_ARRAY_BUFFER, _posVbo);
-  glVertexAttribPointer(0, 3, GL_FLOAT, GL_FALSE, 3*sizeof(GLfloat), 0);
-
-  glEnableVertexAttribArray(1);
-  glBindBuffer(GL_ARRAY_BUFFER, _normalVbo);
-  glVertexAttribPointer(1, 3, GL_FLOAT, GL_FALSE, 3*sizeof(GLfloat), 0);
-
-  glEnableVertexAttribArray(2);
-  glBindBuffer(GL_ARRAY_BUFFER, _texCoordVbo);
-  glVertexAttribPointer(2, 2, GL_FLOAT, GL_FALSE, 2*sizeof(GLfloat), 0);
-
-  glBindBuffer(GL_ELEMENT_ARRAY_BUFFER, _ibo);
-  glBindVertexArray(0); // Desactive the VAO just created. Will be activated at rendering time.
-}
-
-void Mesh::initOldGL()
-{
-  // Generate a GPU buffer to store the positions of the vertices
-  size_t vertexBufferSize = sizeof(glm::vec3)*_vertexPositions.size();
-  glGenBuffers(1, &_posVbo);
-  glBindBuffer(GL_ARRAY_BUFFER, _posVbo);
-  glBufferData(GL_ARRAY_BUFFER, vertexBufferSize, _vertexPositions.data(), GL_DYNAMIC_READ);
-
-  // Same for normal
-  glGenBuffers(1, &_normalVbo);
-  glBindBuffer(GL_ARRAY_BUFFER, _normalVbo);
-  glBufferData(GL_ARRAY_BUFFER, vertexBufferSize, _vertexNormals.data(), GL_DYNAMIC_READ);
-
-  // Same for texture coordinates
-  size_t texCoordBufferSize = sizeof(glm::vec2)*_vertexTexCoords.size();
-  glGenBuffers(1, &_texCoordVbo);
-  glBindBuffer(GL_ARRAY_BUFFER, _texCoordVbo);
-  glBufferData(GL_ARRAY_BUFFER, texCoordBufferSize, _vertexTexCoords.data(), GL_DYNAMIC_READ);
-
-  // Same for the index buffer that stores the list of indices of the triangles forming the mesh
-  size_t indexBufferSize = sizeof(glm::uvec3)*_triangleIndices.size();
-  glGenBuffers(1, &_ibo);
-  glBindBuffer(GL_ELEMENT_ARRAY_BUFFER, _ibo);
-  glBufferData(GL_ELEMENT_ARRAY_BUFFER, indexBufferSize, _triangleIndices.data(), GL_DYNAMIC_READ);
-
-  // Create a single handle that joins together attributes (vertex positions, normals) and connectivity (triangles indices)
-  glGenVertexArrays(1, &_vao);
-  glBindVertexArray(_vao);
-
-  glEnableVertexAttribArray(0);
-  glBindBuffer(GL_ARRAY_BUFFER, _posVbo);
-  glVertexAttribPointer(0, 3, GL_FLOAT, GL_FALSE, 3*sizeof(GLfloat), 0);
-
-  glEnableVertexAttribArray(1);
-  glBindBuffer(GL_ARRAY_BUFFER, _normalVbo);
-  glVertexAttribPointer(1, 3, GL_FLOAT, GL_FALSE, 3*sizeof(GLfloat), 0);
-
-  glEnableVertexAttribArray(2);
-  glBindBuffer(GL_ARRAY_BUFFER, _texCoordVbo);
-  glVertexAttribPointer(2, 2, GL_FLOAT, GL_FALSE, 2*sizeof(GLfloat), 0);
-
-  glBindBuffer(GL_ELEMENT_ARRAY_BUFFER, _ibo);
-
-  glBindVertexArray(0); // Desactive the VAO just created. Will be activated at rendering time.
-}
-
-void Mesh::render()
-{
-  glBindVertexArray(_vao);      // Activate the VAO storing geometry data
-  glDrawElements(GL_TRIANGLES, static_cast<GLsizei>(_triangleIndices.size()*3), GL_UNSIGNED_INT, 0);
-  // Call for rendering: stream the current GPU geometry through the current GPU program
-}
-
 void Mesh::clear()
 {
   _vertexPositions.clear();
   _vertexNormals.clear();
   _vertexTexCoords.clear();
   _triangleIndices.clear();
-  if(_vao) {
-    glDeleteVertexArrays(1, &_vao);
-    _vao = 0;
-  }
-  if(_posVbo) {
-    glDeleteBuffers(1, &_posVbo);
-    _posVbo = 0;
-  }
-  if(_normalVbo) {
-    glDeleteBuffers(1, &_normalVbo);
-    _normalVbo = 0;
-  }
-  if(_texCoordVbo) {
-    glDeleteBuffers(1, &_texCoordVbo);
-    _texCoordVbo = 0;
-  }
-  if(_ibo) {
-    glDeleteBuffers(1, &_ibo);
-    _ibo = 0;
-  }
+  _gpu.reset(); // the deleter set by init() frees the GL objects
 }
 
 // Loads an OFF mesh file. See https://en.wikipedia.org/wiki/OFF_(file_format)
@@ -266,19 +153,6 @@ void loadOFF(const std::string &filename, std::shared_ptr<Mesh> meshPtr)
   std::cout << " > Mesh <" << filename << "> loaded" <<  std::endl;
 }
 
-void Mesh::updatePositionsAndNormalsOnGPU()
-{
-  if (_posVbo == 0 || _normalVbo == 0) return;
-
-  size_t posSize = sizeof(glm::vec3) * _vertexPositions.size();
-  size_t nrmSize = sizeof(glm::vec3) * _vertexNormals.size();
-
-  glNamedBufferSubData(_posVbo, 0, posSize, _vertexPositions.data());
-  glNamedBufferSubData(_normalVbo, 0, nrmSize, _vertexNormals.data());
-}
-
-
-
 struct Vertex {
   glm::vec3 p;
   glm::vec3 n;
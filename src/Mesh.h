@@ -1,7 +1,6 @@
 #ifndef MESH_H
 #define MESH_H
 
-#include <glad/glad.h>
 #include <vector>
 #include <memory>
 #include <string>
@@ -9,6 +8,9 @@
 #include <glm/glm.hpp>
 #include <glm/ext.hpp>
 
+// GL buffers of a mesh, see MeshGL.cpp
+struct MeshGPUBuffers;
+
 class Mesh {
 public:
   virtual ~Mesh();
@@ -31,15 +33,16 @@ public:
   void recomputePerVertexNormals(bool angleBased = false);
   void recomputePerVertexTextureCoordinates( );
 
+  // GL side, defined in MeshGL.cpp
   void init();
   void initOldGL();
   void render();
+  void updatePositionsAndNormalsOnGPU();
+
   void clear();
 
   void addPlan(float square_half_side = 1.0f);
 
-  void updatePositionsAndNormalsOnGPU();
-
   void bilateralFilterWelded(int iterations = 2, float spatialSigmaFactor = 2.0f, float normalSigma = 0.6f, float weldEps = 1e-6f);
 
   void saveState();
@@ -53,11 +56,9 @@ private:
   std::vector<glm::vec2> _vertexTexCoords;
   std::vector<glm::uvec3> _triangleIndices;
 
-  GLuint _vao = 0;
-  GLuint _posVbo = 0;
-  GLuint _normalVbo = 0;
-  GLuint _texCoordVbo = 0;
-  GLuint _ibo = 0;
+  // null until init(); its deleter releases the GL objects, so the
+  // CPU-only code never references GL
+  std::shared_ptr<MeshGPUBuffers> _gpu;
 
   std::vector<glm::vec3> _savedPositions;
   std::vector<glm::vec3> _savedNormals;
@@ -0,0 +1,135 @@
+// GL side of Mesh: GPU buffers and drawing. Only the windowed viewer
+// compiles this file, the rest of Mesh does not need a GL context.
+
+#include <glad/glad.h>
+
+#include "Mesh.h"
+
+#include <stdexcept>
+
+struct MeshGPUBuffers {
+  GLuint vao = 0;
+  GLuint posVbo = 0;
+  GLuint normalVbo = 0;
+  GLuint texCoordVbo = 0;
+  GLuint ibo = 0;
+};
+
+static void deleteGPUBuffers(MeshGPUBuffers* b)
+{
+  if(b->vao) glDeleteVertexArrays(1, &b->vao);
+  if(b->posVbo) glDeleteBuffers(1, &b->posVbo);
+  if(b->normalVbo) glDeleteBuffers(1, &b->normalVbo);
+  if(b->texCoordVbo) glDeleteBuffers(1, &b->texCoordVbo);
+  if(b->ibo) glDeleteBuffers(1, &b->ibo);
+  delete b;
+}
+
+void Mesh::init()
+{
+  if (_vertexPositions.empty() || _triangleIndices.empty()) {
+    throw std::runtime_error("[Mesh::init] Empty mesh (no vertices or no triangles). Did you load the file correctly?");
+  }
+  _gpu.reset(new MeshGPUBuffers(), deleteGPUBuffers);
+
+
+  glCreateBuffers(1, &_gpu->posVbo); // Generate a GPU buffer to store the positions of the vertices
+  size_t vertexBufferSize = sizeof(glm::vec3)*_vertexPositions.size(); // Gather the size of the buffer from the CPU-side vector
+  glNamedBufferStorage(_gpu->posVbo, vertexBufferSize, _vertexPositions.data(), GL_DYNAMIC_STORAGE_BIT); // Create a data store on the GPU
+
+  glCreateBuffers(1, &_gpu->normalVbo); // Same for normal
+  glNamedBufferStorage(_gpu->normalVbo, vertexBufferSize, _vertexNormals.data(), GL_DYNAMIC_STORAGE_BIT);
+
+  glCreateBuffers(1, &_gpu->texCoordVbo); // Same for texture coordinates
+  size_t texCoordBufferSize = sizeof(glm::vec2)*_vertexTexCoords.size();
+  glNamedBufferStorage(_gpu->texCoordVbo, texCoordBufferSize, _vertexTexCoords.data(), GL_DYNAMIC_STORAGE_BIT);
+
+  glCreateBuffers(1, &_gpu->ibo); // Same for the index buffer, that stores the list of indices of the triangles forming the mesh
+  size_t indexBufferSize = sizeof(glm::uvec3)*_triangleIndices.size();
+  glNamedBufferStorage(_gpu->ibo, indexBufferSize, _triangleIndices.data(), GL_DYNAMIC_STORAGE_BIT);
+
+  glCreateVertexArrays(1, &_gpu->vao); // Create a single handle that joins together attributes (vertex positions, normals) and connectivity (triangles indices)
+  glBindVertexArray(_gpu->vao);
+
+  glEnableVertexAttribArray(0);
+  glBindBuffer(GL_ARRAY_BUFFER, _gpu->posVbo);
+  glVertexAttribPointer(0, 3, GL_FLOAT, GL_FALSE, 3*sizeof(GLfloat), 0);
+
+  glEnableVertexAttribArray(1);
+  glBindBuffer(GL_ARRAY_BUFFER, _gpu->normalVbo);
+  glVertexAttribPointer(1, 3, GL_FLOAT, GL_FALSE, 3*sizeof(GLfloat), 0);
+
+  glEnableVertexAttribArray(2);
+  glBindBuffer(GL_ARRAY_BUFFER, _gpu->texCoordVbo);
+  glVertexAttribPointer(2, 2, GL_FLOAT, GL_FALSE, 2*sizeof(GLfloat), 0);
+
+  glBindBuffer(GL_ELEMENT_ARRAY_BUFFER, _gpu->ibo);
+  glBindVertexArray(0); // Desactive the VAO just created. Will be activated at rendering time.
+}
+
+void Mesh::initOldGL()
+{
+  _gpu.reset(new MeshGPUBuffers(), deleteGPUBuffers);
+
+  // Generate a GPU buffer to store the positions of the vertices
+  size_t vertexBufferSize = sizeof(glm::vec3)*_vertexPositions.size();
+  glGenBuffers(1, &_gpu->posVbo);
+  glBindBuffer(GL_ARRAY_BUFFER, _gpu->posVbo);
+  glBufferData(GL_ARRAY_BUFFER, vertexBufferSize, _vertexPositions.data(), GL_DYNAMIC_READ);
+
+  // Same for normal
+  glGenBuffers(1, &_gpu->normalVbo);
+  glBindBuffer(GL_ARRAY_BUFFER, _gpu->normalVbo);
+  glBufferData(GL_ARRAY_BUFFER, vertexBufferSize, _vertexNormals.data(), GL_DYNAMIC_READ);
+
+  // Same for texture coordinates
+  size_t texCoordBufferSize = sizeof(glm::vec2)*_vertexTexCoords.size();
+  glGenBuffers(1, &_gpu->texCoordVbo);
+  glBindBuffer(GL_ARRAY_BUFFER, _gpu->texCoordVbo);
+  glBufferData(GL_ARRAY_BUFFER, texCoordBufferSize, _vertexTexCoords.data(), GL_DYNAMIC_READ);
+
+  // Same for the index buffer that stores the list of indices of the triangles forming the mesh
+  size_t indexBufferSize = sizeof(glm::uvec3)*_triangleIndices.size();
+  glGenBuffers(1, &_gpu->ibo);
+  glBindBuffer(GL_ELEMENT_ARRAY_BUFFER, _gpu->ibo);
+  glBufferData(GL_ELEMENT_ARRAY_BUFFER, indexBufferSize, _triangleIndices.data(), GL_DYNAMIC_READ);
+
+  // Create a single handle that joins together attributes (vertex positions, normals) and connectivity (triangles indices)
+  glGenVertexArrays(1, &_gpu->vao);
+  glBindVertexArray(_gpu->vao);
+
+  glEnableVertexAttribArray(0);
+  glBindBuffer(GL_ARRAY_BUFFER, _gpu->posVbo);
+  glVertexAttribPointer(0, 3, GL_FLOAT, GL_FALSE, 3*sizeof(GLfloat), 0);
+
+  glEnableVertexAttribArray(1);
+  glBindBuffer(GL_ARRAY_BUFFER, _gpu->normalVbo);
+  glVertexAttribPointer(1, 3, GL_FLOAT, GL_FALSE, 3*sizeof(GLfloat), 0);
+
+  glEnableVertexAttribArray(2);
+  glBindBuffer(GL_ARRAY_BUFFER, _gpu->texCoordVbo);
+  glVertexAttribPointer(2, 2, GL_FLOAT, GL_FALSE, 2*sizeof(GLfloat), 0);
+
+  glBindBuffer(GL_ELEMENT_ARRAY_BUFFER, _gpu->ibo);
+
+  glBindVertexArray(0); // Desactive the VAO just created. Will be activated at rendering time.
+}
+
+void Mesh::render()
+{
+  if(!_gpu) return;
+  glBindVertexArray(_gpu->vao);      // Activate the VAO storing geometry data
+  glDrawElements(GL_TRIANGLES, static_cast<GLsizei>(_triangleIndices.size()*3), GL_UNSIGNED_INT, 0);
+  // Call for rendering: stream the current GPU geometry through the current GPU program
+}
+
+void Mesh::updatePositionsAndNormalsOnGPU()
+{
+  if (!_gpu || _gpu->posVbo == 0 || _gpu->normalVbo == 0) return;
+
+  size_t posSize = sizeof(glm::vec3) * _vertexPositions.size();
+  size_t nrmSize = sizeof(glm::vec3) * _vertexNormals.size();
+
+  glNamedBufferSubData(_gpu->posVbo, 0, posSize, _vertexPositions.data());
+  glNamedBufferSubData(_gpu->normalVbo, 0, nrmSize, _vertexNormals.data());
+}
@@ -0,0 +1,85 @@
+#include "Morton.h"
+#include "ThreadPool.h"
+
+#include <algorithm>
+
+void radixSortPairs(std::vector<uint32_t>& keys, std::vector<int>& vals, ThreadPool* pool, int grain) {
+  int n = (int)keys.size();
+  int chunks = pool ? std::max(1, std::min(pool->size() * 4, (n + grain - 1) / grain)) : 1;
+  auto chunkBegin = [&](int c) { return (int)((long long)n * c / chunks); };
+
+  std::vector<uint32_t> keys2(n);
+  std::vector<int> vals2(n);
+  std::vector<int> offsets(chunks * 256);
+
+  for(int shift = 0; shift < 32; shift += 8) {
+    std::fill(offsets.begin(), offsets.end(), 0);
+    forChunks(pool, chunks, [&](int c) {
+      int* hist = &offsets[c * 256];
+      for(int i = chunkBegin(c); i < chunkBegin(c + 1); ++i) hist[(keys[i] >> shift) & 255]++;
+    });
+
+    // digit-major prefix sum; a pass where every key has the same digit
+    // would not move anything
+    int sum = 0;
+    bool trivial = false;
+    for(int d = 0; d < 256; ++d) {
+      int digitBegin = sum;
+      for(int c = 0; c < chunks; ++c) {
+        int h = offsets[c * 256 + d];
+        offsets[c * 256 + d] = sum;
+        sum += h;
+      }
+      if(sum - digitBegin == n) trivial = true;
+    }
+    if(trivial) continue;
+
+    forChunks(pool, chunks, [&](int c) {
+      int* offs = &offsets[c * 256];
+      for(int i = chunkBegin(c); i < chunkBegin(c + 1); ++i) {
+        int pos = offs[(keys[i] >> shift) & 255]++;
+        keys2[pos] = keys[i];
+        vals2[pos] = vals[i];
+      }
+    });
+    keys.swap(keys2);
+    vals.swap(vals2);
+  }
+}
+
+void coherentRayOrder(const float* ox, const float* oy, const float* oz,
+                      const float* dx, const float* dy, const float* dz,
+                      int n, std::vector<int>& order, ThreadPool* pool) {
+  const int grain = 16384;
+  const float CELLS = 16.f; // per axis of the origins' bounds
+
+  glm::vec3 bmin(1e30f), bmax(-1e30f);
+  for(int i = 0; i < n; ++i) {
+    glm::vec3 o(ox[i], oy[i], oz[i]);
+    bmin = glm::min(bmin, o);
+    bmax = glm::max(bmax, o);
+  }
+  glm::vec3 ext = bmax - bmin;
+  glm::vec3 scale(ext.x > 0.f ? CELLS / ext.x : 0.f,
+                  ext.y > 0.f ? CELLS / ext.y : 0.f,
+                  ext.z > 0.f ? CELLS / ext.z : 0.f);
+
+  // 15-bit bin: the octant above the cell's 12-bit Morton code. Finer
+  // cells did not make the traversal faster, and the short key sorts in
+  // two radix passes.
+  std::vector<uint32_t> keys(n);
+  order.resize(n);
+  parallelChunks(pool, n, grain, [&](int begin, int end) {
+    for(int i = begin; i < end; ++i) {
+      glm::vec3 q = (glm::vec3(ox[i], oy[i], oz[i]) - bmin) * scale;
+      uint32_t x = (uint32_t)std::min(CELLS - 1.f, std::max(0.f, q.x));
+      uint32_t y = (uint32_t)std::min(CELLS - 1.f, std::max(0.f, q.y));
+      uint32_t z = (uint32_t)std::min(CELLS - 1.f, std::max(0.f, q.z));
+      uint32_t octant = (dx[i] < 0.f ? 4u : 0u) | (dy[i] < 0.f ? 2u : 0u) | (dz[i] < 0.f ? 1u : 0u);
+      keys[i] = (octant << 12) | morton3D(x, y, z);
+      order[i] = i;
+    }
+  });
+
+  radixSortPairs(keys, order, pool, grain);
+}
@@ -0,0 +1,34 @@
+#pragma once
+#include <glm/glm.hpp>
+#include <cstdint>
+#include <vector>
+
+class ThreadPool;
+
+// spreads the low 10 bits of v so two zero bits follow each of them
+inline uint32_t expandBits(uint32_t v) {
+  v = (v * 0x00010001u) & 0xFF0000FFu;
+  v = (v * 0x00000101u) & 0x0F00F00Fu;
+  v = (v * 0x00000011u) & 0xC30C30C3u;
+  v = (v * 0x00000005u) & 0x49249249u;
+  return v;
+}
+
+// 30-bit Morton code of a point quantized to 10 bits per axis
+inline uint32_t morton3D(uint32_t x, uint32_t y, uint32_t z) {
+  return (expandBits(x) << 2) | (expandBits(y) << 1) | expandBits(z);
+}
+
+// LSD radix sort of (key, value) pairs, 8 bits per pass, spread over the
+// pool in chunks of at least grain pairs. Stable, so the result does not
+// depend on the number of chunks.
+void radixSortPairs(std::vector<uint32_t>& keys, std::vector<int>& vals, ThreadPool* pool, int grain);
+
+// Traversal order for a batch of rays, so that consecutive rays walk the
+// same BVH nodes: the rays are binned by direction octant and by the cell of
+// their origin in a 16^3 grid over the batch's bounds, cells in Morton
+// order. Stable inside a bin. order receives the indices of the n rays in
+// ox..dz.
+void coherentRayOrder(const float* ox, const float* oy, const float* oz,
+                      const float* dx, const float* dy, const float* dz,
+                      int n, std::vector<int>& order, ThreadPool* pool = nullptr);
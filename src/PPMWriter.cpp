@@ -0,0 +1,184 @@
+#include "PPMWriter.h"
+
+#include <algorithm>
+#include <cmath>
+#include <cstdint>
+#include <cstring>
+#include <limits>
+#include <sstream>
+
+#if defined(__SSE2__) || defined(_M_X64) || (defined(_M_IX86_FP) && _M_IX86_FP >= 2)
+#define PPM_USE_SSE 1
+#include <emmintrin.h>
+#endif
+
+// Reference quantization the table reproduces (the original savePPM)
+static int gammaLevel(float c) {
+  return (int)(255.f * std::min(std::pow(c, 1.f/2.2f), 1.f));
+}
+
+// Buckets of the level table: the top 8 mantissa bits of c for every
+// octave in [2^-24, 1]. Smaller values all land in bucket 0 (level 0).
+static const uint32_t BUCKET_SHIFT = 15;
+static const uint32_t BUCKET_FIRST = 0x33800000u >> BUCKET_SHIFT; // 2^-24
+static const uint32_t BUCKET_COUNT = (0x3f800000u >> BUCKET_SHIFT) - BUCKET_FIRST + 1;
+
+// thr[k] is the smallest c in [0,1] with gammaLevel(c) >= k, found by
+// bisecting the float bit patterns (ordered like the values for c >= 0),
+// so the table agrees with pow() even at the rounding boundaries.
+// base[b] is the level at the start of bucket b; a bucket spans less than
+// one level, so the level of c is base, or base + 1 once c >= thr[base + 1].
+struct GammaTable {
+  float thr[257];
+  uint8_t base[BUCKET_COUNT];
+  GammaTable() {
+    thr[0] = 0.f;
+    for(int k = 1; k < 256; ++k) {
+      uint32_t lo = 0, hi = 0x3f800000u; // 0.f, 1.f
+      while(lo < hi) {
+        uint32_t mid = lo + (hi - lo) / 2;
+        float c;
+        std::memcpy(&c, &mid, sizeof(c));
+        if(gammaLevel(c) >= k) hi = mid; else lo = mid + 1;
+      }
+      std::memcpy(&thr[k], &lo, sizeof(float));
+    }
+    thr[256] = std::numeric_limits<float>::infinity();
+
+    for(uint32_t b = 0; b < BUCKET_COUNT; ++b) {
+      uint32_t bits = (b + BUCKET_FIRST) << BUCKET_SHIFT;
+      float c;
+      std::memcpy(&c, &bits, sizeof(c));
+      base[b] = (uint8_t)(b == 0 ? 0 : gammaLevel(c));
+    }
+  }
+};
+
+static const GammaTable& gammaTable() {
+  static const GammaTable t;
+  return t;
+}
+
+static inline uint8_t lookupLevel(const GammaTable& g, float c, uint32_t bucket) {
+  uint8_t level = g.base[bucket];
+  return (uint8_t)(level + (c >= g.thr[level + 1]));
+}
+
+void toneMapToRGB8(const float* in, unsigned char* out, int n, float exposure) {
+  const GammaTable& g = gammaTable();
+  int i = 0;
+
+#ifdef PPM_USE_SSE
+  const __m128 one = _mm_set1_ps(1.f);
+  const __m128 exp4 = _mm_set1_ps(exposure);
+  const __m128 smallest = _mm_set1_ps(1.f / 16777216.f); // 2^-24
+  const __m128i first = _mm_set1_epi32((int)BUCKET_FIRST);
+
+  for(; i + 4 <= n; i += 4) {
+    // max() also maps NaN to 0
+    __m128 c = _mm_max_ps(_mm_mul_ps(_mm_loadu_ps(in + i), exp4), _mm_setzero_ps());
+    c = _mm_div_ps(c, _mm_add_ps(one, c));
+
+    __m128i bucket = _mm_sub_epi32(_mm_srli_epi32(_mm_castps_si128(_mm_max_ps(c, smallest)), BUCKET_SHIFT), first);
+
+    alignas(16) float cs[4];
+    alignas(16) uint32_t bs[4];
+    _mm_store_ps(cs, c);
+    _mm_store_si128((__m128i*)bs, bucket);
+    out[i]   = lookupLevel(g, cs[0], bs[0]);
+    out[i+1] = lookupLevel(g, cs[1], bs[1]);
+    out[i+2] = lookupLevel(g, cs[2], bs[2]);
+    out[i+3] = lookupLevel(g, cs[3], bs[3]);
+  }
+#endif
+
+  for(; i < n; ++i) {
+    float c = in[i] * exposure;
+    c = c > 0.f ? c / (1.f + c) : 0.f;
+
+    uint32_t bits;
+    float cb = std::max(1.f / 16777216.f, c); // (inf / inf) NaN to bucket 0
+    std::memcpy(&bits, &cb, sizeof(bits));
+    out[i] = lookupLevel(g, c, (bits >> BUCKET_SHIFT) - BUCKET_FIRST);
+  }
+}
+
+bool PPMWriter::open(const std::string& filename, int w, int h, int bandHeight, float exposure) {
+  close();
+
+  _out.open(filename, std::ios::binary | std::ios::trunc);
+  if(!_out) return false;
+
+  _w = w;
+  _h = h;
+  _bandHeight = std::max(1, bandHeight);
+  _exposure = exposure;
+
+  std::ostringstream header;
+  header << "P6\n" << w << " " << h << "\n255\n";
+  std::string hs = header.str();
+  _out.write(hs.data(), (std::streamsize)hs.size());
+  _dataStart = (std::streamoff)hs.size();
+
+  int bandCount = (h + _bandHeight - 1) / _bandHeight;
+  _bands.assign(bandCount, Band());
+  for(int b = 0; b < bandCount; ++b) {
+    int rows = std::min(_bandHeight, h - b * _bandHeight);
+    _bands[b].pixelsLeft = rows * w;
+  }
+  return true;
+}
+
+void PPMWriter::writeTile(int x0, int y0, int x1, int y1, const glm::vec3* pixels, int stride) {
+  if(!_out.is_open()) return;
+
+  for(int b = y0 / _bandHeight; b * _bandHeight < y1; ++b) {
+    int bandY0 = b * _bandHeight;
+    int rowBegin = std::max(y0, bandY0);
+    int rowEnd = std::min(y1, bandY0 + _bandHeight);
+
+    unsigned char* dst;
+    {
+      std::lock_guard<std::mutex> lk(_m);
+      Band& band = _bands[b];
+      if(band.written) continue;
+      if(band.rgb.empty()) band.rgb.assign((size_t)std::min(_bandHeight, _h - bandY0) * _w * 3, 0);
+      dst = band.rgb.data();
+    }
+
+    // tiles never overlap, so the conversion runs outside the lock
+    for(int y = rowBegin; y < rowEnd; ++y) {
+      const glm::vec3* src = pixels + (y - y0) * stride;
+      toneMapToRGB8(&src->x, dst + ((size_t)(y - bandY0) * _w + x0) * 3, (x1 - x0) * 3, _exposure);
+    }
+
+    std::lock_guard<std::mutex> lk(_m);
+    Band& band = _bands[b];
+    band.pixelsLeft -= (rowEnd - rowBegin) * (x1 - x0);
+    if(band.pixelsLeft <= 0) flushBand(b);
+  }
+}
+
+void PPMWriter::flushBand(int b) {
+  Band& band = _bands[b];
+  if(band.written) return;
+  if(band.rgb.empty()) band.rgb.assign((size_t)std::min(_bandHeight, _h - b * _bandHeight) * _w * 3, 0);
+
+  _out.seekp(_dataStart + (std::streamoff)b * _bandHeight * _w * 3);
+  _out.write((const char*)band.rgb.data(), (std::streamsize)band.rgb.size());
+
+  band.written = true;
+  std::vector<unsigned char>().swap(band.rgb);
+}
+
+bool PPMWriter::close() {
+  if(!_out.is_open()) return true;
+
+  std::lock_guard<std::mutex> lk(_m);
+  for(int b = 0; b < (int)_bands.size(); ++b) flushBand(b);
+  _bands.clear();
+
+  bool ok = (bool)_out;
+  _out.close();
+  return ok;
+}
@@ -0,0 +1,48 @@
+#pragma once
+#include <glm/glm.hpp>
+#include <fstream>
+#include <mutex>
+#include <string>
+#include <vector>
+
+// exposure, Reinhard c/(1+c), then gamma 1/2.2 quantized to 8 bits (same
+// truncation as 255 * pow(c, 1/2.2)). Works on n floats, so any number of
+// RGB pixels: the three channels get the same curve.
+void toneMapToRGB8(const float* in, unsigned char* out, int n, float exposure);
+
+// Binary PPM (P6) writer that takes the image tile by tile, in any order and
+// from any thread. The rows are buffered in bands of bandHeight rows; a band
+// is tone mapped into its 8-bit buffer as tiles arrive and written in one
+// block (then freed) as soon as it is complete, so only the unfinished
+// bands are ever held in memory.
+class PPMWriter {
+public:
+  ~PPMWriter() { close(); }
+
+  // Writes the header; bandHeight should match the tile height
+  bool open(const std::string& filename, int w, int h, int bandHeight = 16, float exposure = 1.0f);
+
+  // Pixels [x0,x1) x [y0,y1); pixels points at (x0, y0), stride is the
+  // row pitch in pixels
+  void writeTile(int x0, int y0, int x1, int y1, const glm::vec3* pixels, int stride);
+
+  // Writes the bands still missing tiles (unwritten pixels stay black)
+  bool close();
+
+private:
+  struct Band {
+    std::vector<unsigned char> rgb; // allocated on the first tile
+    int pixelsLeft = 0;
+    bool written = false;
+  };
+
+  std::mutex _m;
+  std::ofstream _out;
+  std::streamoff _dataStart = 0;
+  int _w = 0, _h = 0;
+  int _bandHeight = 16;
+  float _exposure = 1.0f;
+  std::vector<Band> _bands;
+
+  void flushBand(int b);
+};
@@ -0,0 +1,100 @@
+#include "RTScene.h"
+
+#include <cmath>
+
+namespace {
+
+// Octahedral normal encoding: the unit sphere is projected onto the
+// octahedron |x| + |y| + |z| = 1, the lower half folded over the upper one,
+// and the resulting square stored as two 16-bit snorms (error below 1e-4).
+inline glm::vec2 signNotZero(const glm::vec2& v) {
+  return glm::vec2(v.x >= 0.f ? 1.f : -1.f, v.y >= 0.f ? 1.f : -1.f);
+}
+
+uint32_t octEncode(const glm::vec3& n) {
+  float l1 = std::fabs(n.x) + std::fabs(n.y) + std::fabs(n.z);
+  if(!(l1 > 0.f)) return glm::packSnorm2x16(glm::vec2(0.f, 0.f));
+  glm::vec2 e = glm::vec2(n.x, n.y) / l1;
+  if(n.z < 0.f) e = (1.f - glm::abs(glm::vec2(e.y, e.x))) * signNotZero(e);
+  return glm::packSnorm2x16(e);
+}
+
+glm::vec3 octDecode(uint32_t packed) {
+  glm::vec2 e = glm::unpackSnorm2x16(packed);
+  glm::vec3 n(e.x, e.y, 1.f - std::fabs(e.x) - std::fabs(e.y));
+  if(n.z < 0.f) {
+    glm::vec2 f = (1.f - glm::abs(glm::vec2(n.y, n.x))) * signNotZero(glm::vec2(n.x, n.y));
+    n.x = f.x;
+    n.y = f.y;
+  }
+  return glm::normalize(n);
+}
+
+} // namespace
+
+void RTGeometry::clear() {
+  positions.clear();
+  normals.clear();
+  uvs.clear();
+  octNormals.clear();
+  halfUVs.clear();
+  indices.clear();
+  matIds.clear();
+}
+
+void RTGeometry::reserve(size_t vertices, size_t triangles) {
+  positions.reserve(vertices);
+  if(format == RTVertexFormat::Full) {
+    normals.reserve(vertices);
+    uvs.reserve(vertices);
+  } else {
+    octNormals.reserve(vertices);
+    halfUVs.reserve(vertices);
+  }
+  indices.reserve(triangles);
+  matIds.reserve(triangles);
+}
+
+void RTGeometry::resize(size_t vertices, size_t triangles) {
+  positions.resize(vertices);
+  if(format == RTVertexFormat::Full) {
+    normals.resize(vertices);
+    uvs.resize(vertices);
+  } else {
+    octNormals.resize(vertices);
+    halfUVs.resize(vertices);
+  }
+  indices.resize(triangles);
+  matIds.resize(triangles);
+}
+
+uint32_t RTGeometry::addVertex(const glm::vec3& p, const glm::vec3& n, const glm::vec2& uv) {
+  positions.push_back(p);
+  if(format == RTVertexFormat::Full) {
+    normals.push_back(n);
+    uvs.push_back(uv);
+  } else {
+    octNormals.push_back(octEncode(n));
+    halfUVs.push_back(glm::packHalf2x16(uv));
+  }
+  return (uint32_t)positions.size() - 1;
+}
+
+void RTGeometry::setCompact(uint32_t v, const glm::vec3& n, const glm::vec2& uv) {
+  octNormals[v] = octEncode(n);
+  halfUVs[v] = glm::packHalf2x16(uv);
+}
+
+glm::vec3 RTGeometry::normal(uint32_t v) const {
+  return format == RTVertexFormat::Full ? normals[v] : octDecode(octNormals[v]);
+}
+
+glm::vec2 RTGeometry::uv(uint32_t v) const {
+  return format == RTVertexFormat::Full ? uvs[v] : glm::unpackHalf2x16(halfUVs[v]);
+}
+
+size_t RTGeometry::memoryBytes() const {
+  return positions.size() * sizeof(glm::vec3) + normals.size() * sizeof(glm::vec3) + uvs.size() * sizeof(glm::vec2) +
+         octNormals.size() * sizeof(uint32_t) + halfUVs.size() * sizeof(uint32_t) +
+         indices.size() * sizeof(glm::uvec3) + matIds.size() * sizeof(int);
+}
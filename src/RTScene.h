@@ -0,0 +1,104 @@
+#pragma once
+#include <glm/glm.hpp>
+#include <cstdint>
+#include <vector>
+#include "Texture2D.h"
+
+struct RTMaterial {
+  glm::vec3 albedo = glm::vec3(0.8f);
+  bool useTexture = false;
+  int texId = -1;
+  bool shadowCatcher = true;
+};
+
+// How RTGeometry stores the vertex normals and uvs
+enum class RTVertexFormat {
+  Full,   // float normals and uvs, 32 bytes per vertex with the position
+  Compact // octahedral 2x16-bit normals and half precision uvs, 20 bytes
+};
+
+// Indexed triangles: every vertex is stored once and shared by the
+// triangles around it. Positions stay in full precision, the BVH is built
+// from them. Pick the format while the geometry is empty.
+struct RTGeometry {
+  RTVertexFormat format = RTVertexFormat::Full;
+
+  std::vector<glm::vec3> positions;
+  std::vector<glm::vec3> normals;   // Full
+  std::vector<glm::vec2> uvs;       // Full
+  std::vector<uint32_t> octNormals; // Compact
+  std::vector<uint32_t> halfUVs;    // Compact
+
+  std::vector<glm::uvec3> indices;  // per triangle, into the vertex arrays
+  std::vector<int> matIds;          // per triangle
+
+  size_t size() const { return indices.size(); }
+  bool empty() const { return indices.empty(); }
+  size_t vertexCount() const { return positions.size(); }
+
+  // drops the vertices and triangles, keeps the format
+  void clear();
+  void reserve(size_t vertices, size_t triangles);
+  void resize(size_t vertices, size_t triangles);
+
+  // appends a vertex in the geometry's format, returns its index
+  uint32_t addVertex(const glm::vec3& p, const glm::vec3& n, const glm::vec2& uv);
+
+  // overwrites vertex v, which must exist
+  void setVertex(uint32_t v, const glm::vec3& p, const glm::vec3& n, const glm::vec2& uv) {
+    positions[v] = p;
+    if(format == RTVertexFormat::Full) {
+      normals[v] = n;
+      uvs[v] = uv;
+    } else {
+      setCompact(v, n, uv);
+    }
+  }
+  void addTriangle(const glm::uvec3& idx, int matId) {
+    indices.push_back(idx);
+    matIds.push_back(matId);
+  }
+
+  // vertex attributes, decoded
+  glm::vec3 normal(uint32_t v) const;
+  glm::vec2 uv(uint32_t v) const;
+
+  const glm::vec3& p(size_t tri, int corner) const { return positions[indices[tri][corner]]; }
+
+  size_t memoryBytes() const;
+
+private:
+  void setCompact(uint32_t v, const glm::vec3& n, const glm::vec2& uv);
+};
+
+// Triangles in the mesh's own object space, shared by all its instances
+struct RTMesh {
+  RTGeometry tris;
+};
+
+struct RTInstance {
+  int meshId = -1;
+  glm::mat4 transform = glm::mat4(1.f); // object to world
+  int matId = -1;                       // overrides the triangles' matId when >= 0
+};
+
+struct RTScene {
+  RTGeometry tris;                      // world space geometry, baked in place
+  std::vector<RTMesh> meshes;
+  std::vector<RTInstance> instances;
+  std::vector<RTMaterial> mats;
+  std::vector<Texture2D> textures;
+};
+
+struct RTCamera {
+  glm::vec3 pos;
+  glm::mat4 invView;
+  float fovYDegrees = 45.f;
+  float aspect = 1.f;
+};
+
+struct RTLight {
+  glm::vec3 position;
+  glm::vec3 color = glm::vec3(1.f);
+  float intensity = 1.f;
+};
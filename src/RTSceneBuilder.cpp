@@ -0,0 +1,144 @@
+#include "RTSceneBuilder.h"
+#include "ThreadPool.h"
+
+#include <algorithm>
+#include <cmath>
+
+#if defined(__SSE2__) || defined(_M_X64) || (defined(_M_IX86_FP) && _M_IX86_FP >= 2)
+#define RT_USE_SSE 1
+#include <xmmintrin.h>
+#endif
+
+namespace {
+
+// vertices and triangles per task
+const int VERTEX_CHUNK = 8192;
+const int TRIANGLE_CHUNK = 16384;
+
+} // namespace
+
+void RTSceneBuilder::queue(int target, const Mesh& mesh, const glm::mat4& modelMat, int matId) {
+  Job job;
+  job.target = target;
+  job.mesh = &mesh;
+  job.modelMat = modelMat;
+  job.normalMat = glm::transpose(glm::inverse(glm::mat3(modelMat)));
+  job.matId = matId;
+  _jobs.push_back(job);
+}
+
+void RTSceneBuilder::appendStatic(const Mesh& mesh, const glm::mat4& modelMat, int matId) {
+  queue(-1, mesh, modelMat, matId);
+}
+
+int RTSceneBuilder::addMesh(const Mesh& mesh, int matId) {
+  _rt.meshes.push_back(RTMesh());
+  _rt.meshes.back().tris.format = _rt.tris.format;
+  int meshId = (int)_rt.meshes.size() - 1;
+  queue(meshId, mesh, glm::mat4(1.f), matId);
+  return meshId;
+}
+
+void RTSceneBuilder::replaceMesh(int meshId, const Mesh& mesh, int matId) {
+  _rt.meshes[meshId].tris.clear();
+  queue(meshId, mesh, glm::mat4(1.f), matId);
+}
+
+// Vertices [begin, end) of the job's mesh into the target. The arithmetic
+// is glm's, in the same order (modelMat * vec4(p, 1), then normalize()), so
+// the SSE lanes give the same floats as the scalar tail.
+void RTSceneBuilder::transformVertices(const Job& job, RTGeometry& out, int begin, int end) {
+  const std::vector<glm::vec3>& P = job.mesh->vertexPositions();
+  const std::vector<glm::vec3>& N = job.mesh->vertexNormals();
+  const std::vector<glm::vec2>& UV = job.mesh->vertexTexCoords();
+  const glm::mat4& m = job.modelMat;
+  const glm::mat3& nm = job.normalMat;
+
+  int v = begin;
+#ifdef RT_USE_SSE
+  for(; v + 4 <= end; v += 4) {
+    __m128 x = _mm_setr_ps(P[v].x, P[v+1].x, P[v+2].x, P[v+3].x);
+    __m128 y = _mm_setr_ps(P[v].y, P[v+1].y, P[v+2].y, P[v+3].y);
+    __m128 z = _mm_setr_ps(P[v].z, P[v+1].z, P[v+2].z, P[v+3].z);
+
+    alignas(16) float p[3][4];
+    for(int a = 0; a < 3; ++a) {
+      __m128 xy = _mm_add_ps(_mm_mul_ps(_mm_set1_ps(m[0][a]), x), _mm_mul_ps(_mm_set1_ps(m[1][a]), y));
+      __m128 zw = _mm_add_ps(_mm_mul_ps(_mm_set1_ps(m[2][a]), z), _mm_set1_ps(m[3][a]));
+      _mm_store_ps(p[a], _mm_add_ps(xy, zw));
+    }
+
+    x = _mm_setr_ps(N[v].x, N[v+1].x, N[v+2].x, N[v+3].x);
+    y = _mm_setr_ps(N[v].y, N[v+1].y, N[v+2].y, N[v+3].y);
+    z = _mm_setr_ps(N[v].z, N[v+1].z, N[v+2].z, N[v+3].z);
+
+    __m128 n[3];
+    for(int a = 0; a < 3; ++a)
+      n[a] = _mm_add_ps(_mm_add_ps(_mm_mul_ps(_mm_set1_ps(nm[0][a]), x), _mm_mul_ps(_mm_set1_ps(nm[1][a]), y)),
+                        _mm_mul_ps(_mm_set1_ps(nm[2][a]), z));
+    __m128 len2 = _mm_add_ps(_mm_add_ps(_mm_mul_ps(n[0], n[0]), _mm_mul_ps(n[1], n[1])), _mm_mul_ps(n[2], n[2]));
+    __m128 inv = _mm_div_ps(_mm_set1_ps(1.f), _mm_sqrt_ps(len2));
+    alignas(16) float nn[3][4];
+    for(int a = 0; a < 3; ++a) _mm_store_ps(nn[a], _mm_mul_ps(n[a], inv));
+
+    for(int l = 0; l < 4; ++l)
+      out.setVertex(job.firstVertex + v + l, glm::vec3(p[0][l], p[1][l], p[2][l]), glm::vec3(nn[0][l], nn[1][l], nn[2][l]),
+                    UV.empty() ? glm::vec2(0.0f) : UV[v + l]);
+  }
+#endif
+
+  for(; v < end; ++v)
+    out.setVertex(job.firstVertex + v, glm::vec3(m * glm::vec4(P[v], 1.f)), glm::normalize(nm * N[v]),
+                  UV.empty() ? glm::vec2(0.0f) : UV[v]);
+}
+
+void RTSceneBuilder::build(ThreadPool* pool) {
+  // every target sized once: its current content, then the queued meshes
+  // in order
+  std::vector<size_t> vertices(_rt.meshes.size() + 1), triangles(_rt.meshes.size() + 1);
+  for(size_t t = 0; t < vertices.size(); ++t) {
+    RTGeometry& g = geometry((int)t - 1);
+    vertices[t] = g.vertexCount();
+    triangles[t] = g.size();
+  }
+  for(Job& job : _jobs) {
+    job.firstVertex = (uint32_t)vertices[job.target + 1];
+    job.firstTri = triangles[job.target + 1];
+    vertices[job.target + 1] += job.mesh->vertexPositions().size();
+    triangles[job.target + 1] += job.mesh->triangleIndices().size();
+  }
+  for(size_t t = 0; t < vertices.size(); ++t) geometry((int)t - 1).resize(vertices[t], triangles[t]);
+
+  // chunks of the vertices and triangles of every mesh
+  struct Task {
+    int job;
+    bool tris;
+    int begin, end;
+  };
+  std::vector<Task> tasks;
+  for(int j = 0; j < (int)_jobs.size(); ++j) {
+    int nv = (int)_jobs[j].mesh->vertexPositions().size();
+    int nt = (int)_jobs[j].mesh->triangleIndices().size();
+    for(int b = 0; b < nv; b += VERTEX_CHUNK) tasks.push_back(Task{ j, false, b, std::min(b + VERTEX_CHUNK, nv) });
+    for(int b = 0; b < nt; b += TRIANGLE_CHUNK) tasks.push_back(Task{ j, true, b, std::min(b + TRIANGLE_CHUNK, nt) });
+  }
+
+  forChunks(pool, (int)tasks.size(), [&](int i) {
+    const Task& task = tasks[i];
+    const Job& job = _jobs[task.job];
+    RTGeometry& out = geometry(job.target);
+    if(!task.tris) {
+      transformVertices(job, out, task.begin, task.end);
+      return;
+    }
+
+    const std::vector<glm::uvec3>& T = job.mesh->triangleIndices();
+    glm::uvec3 base(job.firstVertex);
+    for(int t = task.begin; t < task.end; ++t) {
+      out.indices[job.firstTri + t] = T[t] + base;
+      out.matIds[job.firstTri + t] = job.matId;
+    }
+  });
+
+  _jobs.clear();
+}
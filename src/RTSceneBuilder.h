@@ -0,0 +1,51 @@
+#pragma once
+#include <glm/glm.hpp>
+#include <vector>
+#include "Mesh.h"
+#include "RTScene.h"
+
+class ThreadPool;
+
+// Fills the geometry of an RTScene from Meshes. Meshes are only queued by
+// the calls below; build() sizes every target geometry once for all of
+// them, then transforms each vertex exactly once (four at a time with SSE)
+// and offsets the indices, spread over the pool in chunks of every mesh.
+// The result is the same as appending the meshes one by one in queue
+// order, whatever the thread count.
+class RTSceneBuilder {
+public:
+  explicit RTSceneBuilder(RTScene& rt) : _rt(rt) {}
+
+  // static geometry, baked into world space in scene.tris
+  void appendStatic(const Mesh& mesh, const glm::mat4& modelMat, int matId);
+
+  // object space copy of the mesh in a new scene.meshes entry, in the
+  // vertex format of scene.tris; place it with addRTInstance()
+  int addMesh(const Mesh& mesh, int matId);
+
+  // replaces the geometry of scene.meshes[meshId] with the mesh's
+  void replaceMesh(int meshId, const Mesh& mesh, int matId);
+
+  // The queued meshes must stay alive until then; the queue is emptied.
+  void build(ThreadPool* pool = nullptr);
+
+private:
+  struct Job {
+    int target = -1; // -1: scene.tris, else a scene.meshes index
+    const Mesh* mesh = nullptr;
+    glm::mat4 modelMat = glm::mat4(1.f);
+    glm::mat3 normalMat = glm::mat3(1.f);
+    int matId = 0;
+    uint32_t firstVertex = 0; // in the target, set by build()
+    size_t firstTri = 0;
+  };
+
+  RTScene& _rt;
+  std::vector<Job> _jobs;
+
+  RTGeometry& geometry(int target) { return target < 0 ? _rt.tris : _rt.meshes[target].tris; }
+
+  void queue(int target, const Mesh& mesh, const glm::mat4& modelMat, int matId);
+
+  static void transformVertices(const Job& job, RTGeometry& out, int begin, int end);
+};
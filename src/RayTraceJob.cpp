@@ -0,0 +1,54 @@
+#include "RayTraceJob.h"
+
+void RayTraceJob::start(const RayTracer& tracer, const RTScene& scene, const RTCamera& cam, const RTLight& light, int maxSamples) {
+  cancel();
+
+  _cam = cam;
+  _light = light;
+  _cancel = false;
+  _done = false;
+  _passes = 0;
+  _width = tracer.width();
+
+  _thread = std::thread([this, &tracer, &scene, maxSamples]() {
+    if(maxSamples <= 1) {
+      tracer.render(scene, _cam, _light, _img,
+        [this](int x0, int y0, int x1, int y1) { pushTile(x0, y0, x1, y1, false); },
+        &_cancel);
+      _passes = 1;
+    } else {
+      _accum.reset(tracer.width(), tracer.height(), RayTracer::tileSize());
+      for(int pass = 0; pass < maxSamples && !_cancel; ++pass) {
+        int active = tracer.renderPass(scene, _cam, _light, _accum,
+          [this](int x0, int y0, int x1, int y1) { pushTile(x0, y0, x1, y1, true); },
+          &_cancel);
+        _passes = pass + 1;
+        if(active == 0) break;
+      }
+    }
+    _done = true;
+  });
+}
+
+void RayTraceJob::pushTile(int x0, int y0, int x1, int y1, bool accumulated) {
+  RTTile tile;
+  tile.x0 = x0;
+  tile.y0 = y0;
+  tile.w = x1 - x0;
+  tile.h = y1 - y0;
+  tile.pixels.reserve(tile.w * tile.h);
+  for(int y = y0; y < y1; ++y)
+    for(int x = x0; x < x1; ++x)
+      tile.pixels.push_back(accumulated ? _accum.pixel(x, y) : _img[y * _width + x]);
+  _queue.push(std::move(tile));
+}
+
+void RayTraceJob::cancel() {
+  _cancel = true;
+  if(_thread.joinable()) _thread.join();
+  _queue.clear();
+}
+
+void RayTraceJob::finish() {
+  if(_thread.joinable()) _thread.join();
+}
@@ -0,0 +1,57 @@
+#pragma once
+#include <atomic>
+#include <thread>
+#include <vector>
+#include "RayTracer.h"
+#include "TileQueue.h"
+
+// Runs RayTracer::render() on a background thread. Finished tiles go
+// through a TileQueue so the GL thread can upload them as they arrive.
+//
+// The job reads the tracer and the scene while it runs: the caller must
+// not change either before cancel() or finish() returned. The camera and
+// the light are copied.
+class RayTraceJob {
+public:
+  ~RayTraceJob() { cancel(); }
+
+  // Cancels a running job first. With maxSamples > 1 the job accumulates
+  // jittered passes (see RayTracer::renderPass) until every tile converged
+  // or maxSamples passes were taken, queueing a tile again after each pass.
+  void start(const RayTracer& tracer, const RTScene& scene, const RTCamera& cam, const RTLight& light, int maxSamples = 1);
+
+  // Stops the worker and drops the queued tiles; blocks until the tiles
+  // already being traced are done.
+  void cancel();
+
+  // Joins the worker once done(); the tiles still queued are kept
+  void finish();
+
+  bool running() const { return _thread.joinable(); }
+
+  // every tile has been traced (and queued)
+  bool done() const { return _done.load(); }
+
+  // passes finished so far
+  int passes() const { return _passes.load(); }
+
+  const RTCamera& camera() const { return _cam; }
+
+  // Tiles finished since the last call, oldest first
+  void popTiles(std::vector<RTTile>& out) { _queue.popAll(out); }
+
+private:
+  std::thread _thread;
+  std::atomic<bool> _cancel{false};
+  std::atomic<bool> _done{false};
+  std::atomic<int> _passes{0};
+  TileQueue _queue;
+
+  RTCamera _cam;
+  RTLight _light;
+  int _width = 0;
+  std::vector<glm::vec3> _img;
+  RTAccumBuffer _accum;
+
+  void pushTile(int x0, int y0, int x1, int y1, bool accumulated);
+};
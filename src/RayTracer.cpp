@@ -1,54 +1,107 @@
 #include "RayTracer.h"
+#include "PPMWriter.h"
 
+#include <cstdio>
 #include <fstream>
 #include <iostream>
 #include <algorithm>
+#include <cassert>
 #include <cmath>
 #include <limits>
+#include <cstdint>
+#include <mutex>
 
 static inline float clamp01(float x) { return std::max(0.f, std::min(1.f, x)); }
 
+RayTracer::RayTracer(int w, int h) : _w(w), _h(h), _pool(std::make_shared<ThreadPool>(_threadCount)) {}
 
+bool RayTracer::intersectScene(const RTRay& ray, RTHit& hit, float tMaxLimit) const {
+  rtThreadStats().rays++;
 
-bool RayTracer::intersectTriangle(const glm::vec3& ro, const glm::vec3& rd, const RTTriangle& tri, float& t, float& u, float& v) {
-  const float EPS = 1e-7f;
-  glm::vec3 e1 = tri.p1 - tri.p0;
-  glm::vec3 e2 = tri.p2 - tri.p0;
-  glm::vec3 pvec = glm::cross(rd, e2);
-  float det = glm::dot(e1, pvec);
+  bool any = false;
+  if(_sceneBVH.intersect(ray, hit, tMaxLimit)) {
+    hit.inst = -1;
+    any = true;
+  }
+  if(intersectInstances(ray, hit, tMaxLimit)) any = true;
+  return any;
+}
 
-  if (std::fabs(det) < EPS) return false;
-  float invDet = 1.f / det;
+void RayTracer::finalizeHit(const RTScene& scene, const RTRay& ray, RTHit& hit) const {
+  hit.p = ray.o + hit.t * ray.d;
+  float w = 1.0f - hit.u - hit.v;
 
-  glm::vec3 tvec = ro - tri.p0;
-  u = glm::dot(tvec, pvec) * invDet;
-  if (u < 0.f || u > 1.f) return false;
+  // the hit triangle's vertex attributes, decoded for a compact geometry
+  auto interpolate = [&](const RTGeometry& tris, int prim, glm::vec3& n) {
+    const glm::uvec3& idx = tris.indices[prim];
+    if(tris.format == RTVertexFormat::Full) {
+      hit.uv = w*tris.uvs[idx[0]] + hit.u*tris.uvs[idx[1]] + hit.v*tris.uvs[idx[2]];
+      n = w*tris.normals[idx[0]] + hit.u*tris.normals[idx[1]] + hit.v*tris.normals[idx[2]];
+    } else {
+      hit.uv = w*tris.uv(idx[0]) + hit.u*tris.uv(idx[1]) + hit.v*tris.uv(idx[2]);
+      n = w*tris.normal(idx[0]) + hit.u*tris.normal(idx[1]) + hit.v*tris.normal(idx[2]);
+    }
+  };
+
+  glm::vec3 n;
+  if(hit.inst < 0) {
+    int prim = _sceneBVH.primIndex(hit.prim);
+    interpolate(scene.tris, prim, n);
+    hit.n = glm::normalize(n);
+    hit.matId = scene.tris.matIds[prim];
+    return;
+  }
 
-  glm::vec3 qvec = glm::cross(tvec, e1);
-  v = glm::dot(rd, qvec) * invDet;
-  if (v < 0.f || (u + v) > 1.f) return false;
+  // instance hit: the triangle is in object space, only the normal needs
+  // to be brought to world space (p comes from the world ray)
+  const InstanceXform& xf = _instances[hit.inst];
+  const RTGeometry& tris = scene.meshes[xf.meshId].tris;
+  int prim = _meshBVHs[xf.meshId].primIndex(hit.prim);
+  interpolate(tris, prim, n);
+  hit.n = glm::normalize(xf.normalMat * n);
+  hit.matId = xf.matId >= 0 ? xf.matId : tris.matIds[prim];
+}
 
-  t = glm::dot(e2, qvec) * invDet;
-  return t > EPS;
+int RayTracer::intersectPacket(const RTRay* rays, int count, RTHit* hits, float tMax) const {
+  int hitCount = 0;
+  for (int first = 0; first < count; first += BVH::MAX_PACKET) {
+    uint32_t mask = intersectScenePacket(rays + first, std::min(count - first, BVH::MAX_PACKET), hits + first, tMax);
+    for (; mask; mask &= mask - 1) ++hitCount;
+  }
+  return hitCount;
 }
 
-bool RayTracer::intersectScene(const RTScene& scene, const glm::vec3& ro, const glm::vec3& rd, Hit& hit, float tMaxLimit) const {
-  return intersectBVH(scene, ro, rd, hit, tMaxLimit);
+uint32_t RayTracer::intersectScenePacket(const RTRay* rays, int count, RTHit* hits, float tMaxLimit) const {
+  assert(count <= BVH::MAX_PACKET);
+  rtThreadStats().rays += count;
+
+  uint32_t any = _sceneBVH.intersectPacket(rays, count, hits, tMaxLimit);
+  for (int r = 0; r < count; ++r)
+    if (any & (1u << r)) hits[r].inst = -1;
+  return any | intersectInstancesPacket(rays, count, hits, tMaxLimit);
 }
 
+bool RayTracer::occludedScene(const RTRay& ray, float tMax) const {
+  rtThreadStats().rays++;
+  return _sceneBVH.occluded(ray, tMax) || occludedInstances(ray, tMax);
+}
 
-bool RayTracer::isOccluded(const RTScene& scene, const glm::vec3& p, const glm::vec3& n, const glm::vec3& lightPos) const {
+RTRay RayTracer::shadowRay(const glm::vec3& p, const glm::vec3& n, const glm::vec3& lightPos, float& tMax) {
   const float EPS = 1e-4f;
   glm::vec3 ro = p + EPS * n;
   glm::vec3 toL = lightPos - ro;
   float distToL = glm::length(toL);
-  glm::vec3 rd = toL / distToL;
+  tMax = distToL - 1e-3f;
+  return RTRay(ro, toL / distToL);
+}
 
-  Hit h;
-  return intersectScene(scene, ro, rd, h, distToL - 1e-3f);
+bool RayTracer::isOccluded(const glm::vec3& p, const glm::vec3& n, const glm::vec3& lightPos) const {
+  float tMax;
+  RTRay ray = shadowRay(p, n, lightPos, tMax);
+  return occludedScene(ray, tMax);
 }
 
-static bool intersectPlaneY(const glm::vec3& ro, const glm::vec3& rd, float y, float& tOut) {
+bool RayTracer::intersectPlaneY(const glm::vec3& ro, const glm::vec3& rd, float y, float& tOut) {
   float denom = rd.y;
   if (std::abs(denom) < 1e-6f) return false;
   float t = (y - ro.y) / denom;
@@ -58,326 +111,647 @@ static bool intersectPlaneY(const glm::vec3& ro, const glm::vec3& rd, float y, f
 }
 
 
-std::vector<glm::vec3> RayTracer::render(const RTScene& scene, const RTCamera& cam, const RTLight& light) const {
-  std::vector<glm::vec3> img(_w * _h, glm::vec3(0));
+// Interleave the bits of x and y (Z-order / Morton curve)
+static inline uint32_t part1By1(uint32_t x) {
+  x &= 0x0000ffff;
+  x = (x | (x << 8)) & 0x00ff00ff;
+  x = (x | (x << 4)) & 0x0f0f0f0f;
+  x = (x | (x << 2)) & 0x33333333;
+  x = (x | (x << 1)) & 0x55555555;
+  return x;
+}
 
-  float tanHalf = std::tan(glm::radians(cam.fovYDegrees) * 0.5f);
+static inline uint32_t morton2D(uint32_t x, uint32_t y) {
+  return part1By1(x) | (part1By1(y) << 1);
+}
 
-  for (int y = 0; y < _h; ++y) {
-    for (int x = 0; x < _w; ++x) {
+// Hash of a pixel and a pass index, for the sample jitter. Only depends on
+// its inputs, so the image does not depend on which thread traced a tile.
+static inline uint32_t hashPixel(uint32_t x, uint32_t y, uint32_t pass) {
+  uint32_t h = x * 0x8da6b343u ^ y * 0xd8163841u ^ pass * 0xcb1ab31fu;
+  h ^= h >> 16; h *= 0x7feb352du;
+  h ^= h >> 15; h *= 0x846ca68bu;
+  h ^= h >> 16;
+  return h;
+}
 
-      float px = ( (x + 0.5f) / float(_w) ) * 2.f - 1.f;
-      float py = 1.f - ( (y + 0.5f) / float(_h) ) * 2.f;
+static inline float luminance(const glm::vec3& c) {
+  return 0.2126f * c.r + 0.7152f * c.g + 0.0722f * c.b;
+}
 
+void RTAccumBuffer::reset(int width, int height, int tileSize) {
+  w = width;
+  h = height;
+  tilesX = (w + tileSize - 1) / tileSize;
+  tilesY = (h + tileSize - 1) / tileSize;
+  passes = 0;
+  sum.assign(w * h, glm::vec3(0));
+  lumSqSum.assign(w * h, 0.f);
+  tileSamples.assign(tilesX * tilesY, 0);
+  tileError.assign(tilesX * tilesY, std::numeric_limits<float>::infinity());
+  tileConverged.assign(tilesX * tilesY, 0);
+}
 
-      px *= cam.aspect * tanHalf;
-      py *= tanHalf;
+glm::vec3 RTAccumBuffer::pixel(int x, int y) const {
+  int n = tileSamples[(y / RayTracer::tileSize()) * tilesX + x / RayTracer::tileSize()];
+  return n ? sum[y * w + x] / float(n) : glm::vec3(0);
+}
 
-      
-      glm::vec3 dirCam = glm::normalize(glm::vec3(px, py, -1.f));
-      glm::vec3 rd = glm::normalize(glm::vec3(cam.invView * glm::vec4(dirCam, 0.f)));
-      glm::vec3 ro = cam.pos;
+int RTAccumBuffer::activeTiles() const {
+  int n = 0;
+  for (char c : tileConverged) n += c ? 0 : 1;
+  return n;
+}
 
-      int pix = y * _w + x;
+std::vector<glm::vec3> RayTracer::render(const RTScene& scene, const RTCamera& cam, const RTLight& light) const {
+  std::vector<glm::vec3> img;
+  render(scene, cam, light, img, TileCallback(), nullptr);
+  return img;
+}
 
-      glm::vec3 col = background(rd);
+void RayTracer::render(const RTScene& scene, const RTCamera& cam, const RTLight& light,
+                       std::vector<glm::vec3>& img, const TileCallback& onTile,
+                       const std::atomic<bool>* cancel) const {
+  img.assign(_w * _h, glm::vec3(0));
 
-      Hit hitTri;
-      bool hitScene = intersectScene(scene, ro, rd, hitTri, 1e30f);
+  float tanHalf = std::tan(glm::radians(cam.fovYDegrees) * 0.5f);
 
-      float groundY = -1.925f;
-      float tPlane;
-      bool hitPlane = intersectPlaneY(ro, rd, groundY, tPlane);
+  runTiles([&](int, int x0, int y0, int x1, int y1) {
+    glm::vec3 colors[TILE_SIZE * TILE_SIZE];
+    traceTile(scene, cam, light, tanHalf, x0, y0, x1, y1, 0, colors);
 
-      if (!hitScene && !hitPlane) {
-        img[pix] = col;
-        continue;
-      }
+    for (int y = y0; y < y1; ++y)
+      for (int x = x0; x < x1; ++x)
+        img[y * _w + x] = colors[(y - y0) * (x1 - x0) + (x - x0)];
 
-      Hit hit;
-      bool hitIsPlane = false;
-
-      if (hitPlane && (!hitScene || tPlane < hitTri.t)) {
-        hitIsPlane = true;
-        hit.t = tPlane;
-        hit.p = ro + tPlane * rd;
-        hit.n = glm::vec3(0,1,0);
-        hit.uv = glm::vec2(0.0f);
-        hit.matId = -1;
-      } else {
-        hit = hitTri;
-      }
+    if (onTile) onTile(x0, y0, x1, y1);
+  }, cancel);
+}
 
-      if (hitIsPlane) {
-        if (rd.y >= 0.0f) {
-          img[pix] = background(rd);
-          continue;
-        }
+int RayTracer::renderPass(const RTScene& scene, const RTCamera& cam, const RTLight& light,
+                          RTAccumBuffer& acc, const TileCallback& onTile,
+                          const std::atomic<bool>* cancel, float errorThreshold) const {
+  if (acc.w != _w || acc.h != _h) acc.reset(_w, _h, TILE_SIZE);
 
-        glm::vec3 bg = background(rd);
+  float tanHalf = std::tan(glm::radians(cam.fovYDegrees) * 0.5f);
+  const uint32_t pass = (uint32_t)acc.passes;
 
-        bool occ = isOccluded(scene, hit.p, hit.n, light.position);
-        float vis = occ ? 0.0f : 1.0f;
+  runTiles([&](int tile, int x0, int y0, int x1, int y1) {
+    if (acc.tileConverged[tile]) return;
 
-        float strength = 0.6f;
-        float factor = 1.0f - strength * (1.0f - vis);
+    const float n = float(acc.tileSamples[tile] + 1);
+    float errSum = 0.f, meanSum = 0.f;
 
-        img[pix] = bg * factor;
-        continue;
-      }
+    glm::vec3 colors[TILE_SIZE * TILE_SIZE];
+    traceTile(scene, cam, light, tanHalf, x0, y0, x1, y1, pass, colors);
 
-      {
-        const RTMaterial& mat = scene.mats[hit.matId];
+    for (int y = y0; y < y1; ++y)
+      for (int x = x0; x < x1; ++x) {
+        glm::vec3 c = colors[(y - y0) * (x1 - x0) + (x - x0)];
+        float l = luminance(c);
 
-        glm::vec3 Lvec = light.position - hit.p;
-        float dist2 = glm::dot(Lvec, Lvec);
-        float dist  = std::sqrt(dist2);
-        glm::vec3 wi = Lvec / std::max(dist, 1e-6f);
+        int i = y * _w + x;
+        acc.sum[i] += c;
+        acc.lumSqSum[i] += l * l;
 
-        float ndotl = std::max(0.f, glm::dot(hit.n, wi));
-        float atten = 1.0f / std::max(dist2, 1e-4f);
-        glm::vec3 Li = light.color * (light.intensity * atten);
+        // standard error of the pixel mean
+        float mean = luminance(acc.sum[i]) / n;
+        float var = std::max(0.f, acc.lumSqSum[i] / n - mean * mean);
+        errSum += std::sqrt(var / n);
+        meanSum += mean;
+      }
 
-        float vis = isOccluded(scene, hit.p, hit.n, light.position) ? 0.f : 1.f;
+    acc.tileSamples[tile] += 1;
+    acc.tileError[tile] = errSum / (meanSum + 1e-4f);
+    if (acc.tileSamples[tile] >= RTAccumBuffer::MIN_SAMPLES && acc.tileError[tile] < errorThreshold)
+      acc.tileConverged[tile] = 1;
 
-        glm::vec3 albedo = mat.albedo;
-        if (mat.useTexture && mat.texId >= 0) {
-          albedo *= scene.textures[mat.texId].sample(hit.uv);
-        }
+    if (onTile) onTile(x0, y0, x1, y1);
+  }, cancel);
 
-        glm::vec3 ambient = 0.03f * albedo;
-        col = ambient + albedo * Li * ndotl * vis;
+  acc.passes++;
+  return acc.activeTiles();
+}
 
-        img[pix] = col;
+// the first pass goes through the pixel centers, like render()
+void RayTracer::sampleOffset(int x, int y, uint32_t pass, float& jx, float& jy) {
+  jx = jy = 0.5f;
+  if (pass > 0) {
+    uint32_t h = hashPixel((uint32_t)x, (uint32_t)y, pass);
+    jx = float(h & 0xffffu) * (1.f / 65536.f);
+    jy = float(h >> 16) * (1.f / 65536.f);
+  }
+}
+
+void RayTracer::traceTile(const RTScene& scene, const RTCamera& cam, const RTLight& light, float tanHalf,
+                          int x0, int y0, int x1, int y1, uint32_t pass, glm::vec3* out) const {
+  if (_pipeline == RTPipeline::Wavefront) {
+    traceTileWavefront(scene, cam, light, tanHalf, x0, y0, x1, y1, pass, out);
+    return;
+  }
+
+  if (!_primaryPackets) {
+    for (int y = y0; y < y1; ++y)
+      for (int x = x0; x < x1; ++x) {
+        float jx, jy;
+        sampleOffset(x, y, pass, jx, jy);
+        *out++ = tracePixel(scene, cam, light, tanHalf, x + jx, y + jy);
       }
-    }
+    return;
   }
 
-  return img;
+  // camera rays in PACKET_SIZE^2 pixel packets, then shaded one by one
+  const int tw = x1 - x0;
+  for (int by = y0; by < y1; by += PACKET_SIZE)
+    for (int bx = x0; bx < x1; bx += PACKET_SIZE) {
+      int ex = std::min(bx + PACKET_SIZE, x1), ey = std::min(by + PACKET_SIZE, y1);
+
+      RTRay rays[PACKET_SIZE * PACKET_SIZE];
+      RTHit hits[PACKET_SIZE * PACKET_SIZE];
+      int n = 0;
+      for (int y = by; y < ey; ++y)
+        for (int x = bx; x < ex; ++x) {
+          float jx, jy;
+          sampleOffset(x, y, pass, jx, jy);
+          rays[n++] = primaryRay(cam, tanHalf, x + jx, y + jy);
+        }
+
+      uint32_t hitMask = intersectScenePacket(rays, n, hits, 1e30f);
+
+      n = 0;
+      for (int y = by; y < ey; ++y)
+        for (int x = bx; x < ex; ++x, ++n)
+          out[(y - y0) * tw + (x - x0)] = shadePrimary(scene, light, rays[n], (hitMask >> n) & 1u, hits[n]);
+    }
 }
 
-// void RayTracer::savePPM(const std::string& filename, const std::vector<glm::vec3>& pixels, int w, int h) {
-//   std::ofstream out(filename, std::ios::binary);
-//   out << "P6\n" << w << " " << h << "\n255\n";
+void RayTracer::runTiles(const std::function<void(int tile, int x0, int y0, int x1, int y1)>& fn,
+                         const std::atomic<bool>* cancel) const {
+  // tiles in Morton order, so consecutive tiles (and the runs handed to each
+  // worker) cover neighbouring parts of the image and of the BVH
+  const int tilesX = (_w + TILE_SIZE - 1) / TILE_SIZE;
+  const int tilesY = (_h + TILE_SIZE - 1) / TILE_SIZE;
+
+  std::vector<uint32_t> tiles;
+  tiles.reserve(tilesX * tilesY);
+  for (int ty = 0; ty < tilesY; ++ty)
+    for (int tx = 0; tx < tilesX; ++tx)
+      tiles.push_back((uint32_t)(ty * tilesX + tx));
 
-//   for (int i = 0; i < w * h; ++i) {
-    
-//         glm::vec3 c = pixels[i];
+  std::sort(tiles.begin(), tiles.end(), [&](uint32_t a, uint32_t b) {
+    return morton2D(a % tilesX, a / tilesX) < morton2D(b % tilesX, b / tilesX);
+  });
 
-//         float exposure = 1.0f;
-//         c *= exposure;
+  RTStats total;
+  std::mutex statsMutex;
 
-//         c = c / (glm::vec3(1.0f) + c);
-        
-//         c = glm::vec3(std::pow(std::max(c.x, 0.0f), 1.f/2.2f),
-//                     std::pow(std::max(c.y, 0.0f), 1.f/2.2f),
-//                     std::pow(std::max(c.z, 0.0f), 1.f/2.2f));
+  threadPool().parallelFor((int)tiles.size(), [&](int i) {
+    if (cancel && cancel->load(std::memory_order_relaxed)) return;
 
-//         c = glm::clamp(c, glm::vec3(0.0f), glm::vec3(1.0f));
+    RTStats& st = rtThreadStats();
+    RTStats before = st;
 
+    int x0 = (int)(tiles[i] % tilesX) * TILE_SIZE;
+    int y0 = (int)(tiles[i] / tilesX) * TILE_SIZE;
+    int x1 = std::min(x0 + TILE_SIZE, _w);
+    int y1 = std::min(y0 + TILE_SIZE, _h);
 
-//         unsigned char r = (unsigned char)(255.f * c.x);
-//         unsigned char g = (unsigned char)(255.f * c.y);
-//         unsigned char b = (unsigned char)(255.f * c.z);
-//         out.write((char*)&r, 1);
-//         out.write((char*)&g, 1);
-//         out.write((char*)&b, 1);
-//   }
-// }
+    fn((int)tiles[i], x0, y0, x1, y1);
 
-RayTracer::AABB RayTracer::triAABB(const RTTriangle& t) {
-  AABB b;
-  b.bmin = glm::min(t.p0, glm::min(t.p1, t.p2));
-  b.bmax = glm::max(t.p0, glm::max(t.p1, t.p2));
-  return b;
+    std::lock_guard<std::mutex> lk(statsMutex);
+    total.rays         += st.rays - before.rays;
+    total.nodesVisited += st.nodesVisited - before.nodesVisited;
+    total.boxTests     += st.boxTests - before.boxTests;
+    total.triTests     += st.triTests - before.triTests;
+  });
+
+  _stats = total;
 }
 
-RayTracer::AABB RayTracer::mergeAABB(const AABB& a, const AABB& b) {
-  AABB o;
-  o.bmin = glm::min(a.bmin, b.bmin);
-  o.bmax = glm::max(a.bmax, b.bmax);
-  return o;
+void RayTracer::setThreadCount(int n) {
+  _threadCount = n;
+  if (_pool->size() != resolvedThreadCount())
+    _pool = std::make_shared<ThreadPool>(_threadCount);
 }
 
-glm::vec3 RayTracer::triCentroid(const RTTriangle& t) {
-  return (t.p0 + t.p1 + t.p2) * (1.0f/3.0f);
+int RayTracer::resolvedThreadCount() const {
+  if (_threadCount > 0) return _threadCount;
+  return std::max(1, (int)std::thread::hardware_concurrency());
 }
 
-// bool RayTracer::intersectAABB(const glm::vec3& ro, const glm::vec3& rd,
-//                               const AABB& box, float& tminOut, float& tmaxOut)
-// {
-//   float tmin = -1e30f, tmax = 1e30f;
+glm::vec3 RayTracer::tracePixel(const RTScene& scene, const RTCamera& cam, const RTLight& light, float tanHalf, float sx, float sy) const {
+  RTRay ray = primaryRay(cam, tanHalf, sx, sy);
+  RTHit hitTri;
+  bool hitScene = intersectScene(ray, hitTri, 1e30f);
+  return shadePrimary(scene, light, ray, hitScene, hitTri);
+}
 
-//   for(int a=0; a<3; ++a) {
-//     float invD = 1.0f / rd[a];
-//     float t0 = (box.bmin[a] - ro[a]) * invD;
-//     float t1 = (box.bmax[a] - ro[a]) * invD;
-//     if(t0 > t1) std::swap(t0, t1);
-//     tmin = std::max(tmin, t0);
-//     tmax = std::min(tmax, t1);
-//     if(tmax < tmin) return false;
-//   }
+RTRay RayTracer::primaryRay(const RTCamera& cam, float tanHalf, float sx, float sy) const {
+  float px = ( sx / float(_w) ) * 2.f - 1.f;
+  float py = 1.f - ( sy / float(_h) ) * 2.f;
 
-//   tminOut = tmin;
-//   tmaxOut = tmax;
-//   return tmax > 0.0f;
-// }
+  px *= cam.aspect * tanHalf;
+  py *= tanHalf;
 
-bool RayTracer::intersectAABB(const glm::vec3& ro, const glm::vec3& rd, const AABB& box, float& tminOut, float& tmaxOut)
-{
-  const float INF = std::numeric_limits<float>::infinity();
-  float tmin = -INF;
-  float tmax = +INF;
-
-  for (int a = 0; a < 3; ++a) {
-    const float o = ro[a];
-    const float d = rd[a];
-    const float mn = box.bmin[a];
-    const float mx = box.bmax[a];
-
-    if (std::fabs(d) < 1e-12f) {
-      // Ray parallel to slab: must be inside the slab to have intersection
-      if (o < mn || o > mx) { tminOut = tmin; tmaxOut = tmax; return false; }
-      continue;
+  glm::vec3 dirCam = glm::normalize(glm::vec3(px, py, -1.f));
+  glm::vec3 rd = glm::normalize(glm::vec3(cam.invView * glm::vec4(dirCam, 0.f)));
+  return RTRay(cam.pos, rd);
+}
+
+glm::vec3 RayTracer::shadePrimary(const RTScene& scene, const RTLight& light, const RTRay& ray, bool hitScene, const RTHit& hitTri) const {
+  const glm::vec3& ro = ray.o;
+  const glm::vec3& rd = ray.d;
+
+  glm::vec3 col = background(rd);
+
+  // the shadow catching ground plane, when setGround() gave one
+  float tPlane;
+  bool hitPlane = groundMatId >= 0 && intersectPlaneY(ro, rd, groundY, tPlane);
+
+  if (!hitScene && !hitPlane) {
+    return col;
+  }
+
+  RTHit hit;
+  bool hitIsPlane = false;
+
+  if (hitPlane && (!hitScene || tPlane < hitTri.t)) {
+    hitIsPlane = true;
+    hit.t = tPlane;
+    hit.p = ro + tPlane * rd;
+    hit.n = glm::vec3(0,1,0);
+    hit.uv = glm::vec2(0.0f);
+    hit.matId = -1;
+  } else {
+    hit = hitTri;
+    finalizeHit(scene, ray, hit);
+  }
+
+  if (hitIsPlane) {
+    if (rd.y >= 0.0f) {
+      return background(rd);
     }
 
-    float invD = 1.0f / d;
-    float t0 = (mn - o) * invD;
-    float t1 = (mx - o) * invD;
-    if (t0 > t1) std::swap(t0, t1);
+    glm::vec3 bg = background(rd);
+
+    bool occ = isOccluded(hit.p, hit.n, light.position);
+    return shadeGround(bg, occ ? 0.0f : 1.0f);
+  }
+
+  RTSurfaceLight sl = surfaceLight(scene, light, hit.p, hit.n, hit.uv, hit.matId);
+  float vis = isOccluded(hit.p, hit.n, light.position) ? 0.f : 1.f;
+  return sl.shade(vis);
+}
+
+glm::vec3 RayTracer::shadeGround(const glm::vec3& bg, float vis) const {
+  return bg * (1.0f - shadowStrength * (1.0f - vis));
+}
+
+RTSurfaceLight RayTracer::surfaceLight(const RTScene& scene, const RTLight& light, const glm::vec3& p, const glm::vec3& n,
+                                       const glm::vec2& uv, int matId) const {
+  const RTMaterial& mat = scene.mats[matId];
+
+  glm::vec3 Lvec = light.position - p;
+  float dist2 = glm::dot(Lvec, Lvec);
+  float dist  = std::sqrt(dist2);
+  glm::vec3 wi = Lvec / std::max(dist, 1e-6f);
 
-    tmin = std::max(tmin, t0);
-    tmax = std::min(tmax, t1);
+  float ndotl = std::max(0.f, glm::dot(n, wi));
+  float atten = 1.0f / std::max(dist2, 1e-4f);
+  glm::vec3 Li = light.color * (light.intensity * atten);
 
-    if (tmax < tmin) { tminOut = tmin; tmaxOut = tmax; return false; }
+  glm::vec3 albedo = mat.albedo;
+  if (mat.useTexture && mat.texId >= 0) {
+    albedo *= scene.textures[mat.texId].sample(uv);
   }
 
-  tminOut = tmin;
-  tmaxOut = tmax;
-  return true;
+  RTSurfaceLight sl;
+  sl.ambient = 0.03f * albedo;
+  sl.direct = albedo * Li * ndotl;
+  return sl;
 }
 
+bool RayTracer::savePPM(const std::string& filename, const std::vector<glm::vec3>& pixels, int w, int h, float exposure) {
+  PPMWriter out;
+  if(!out.open(filename, w, h, tileSize(), exposure)) return false;
 
-void RayTracer::buildBVH(const RTScene& scene) {
-  bvhNodes.clear();
-  bvhTriIndices.resize(scene.tris.size());
-  for (int i = 0; i < (int)scene.tris.size(); ++i) bvhTriIndices[i] = i;
+  // one band of full rows at a time: each one is written as a single block
+  for(int y0 = 0; y0 < h; y0 += tileSize()) {
+    int y1 = std::min(y0 + tileSize(), h);
+    out.writeTile(0, y0, w, y1, pixels.data() + (size_t)y0 * w, w);
+  }
+  return out.close();
+}
 
-  if(scene.tris.empty()) {
-    bvhBuilt = true;
+void RayTracer::buildCached(BVH& bvh, const RTGeometry& tris) {
+  if(_bvhCacheDir.empty() || tris.empty()) {
+    bvh.build(tris, _buildMode, _layout, &threadPool());
     return;
   }
 
+  uint64_t hash = BVH::contentHash(tris);
+  char name[64];
+  snprintf(name, sizeof(name), "%016llx-%d-%d.bvh", (unsigned long long)hash, (int)_buildMode, (int)_layout);
+  std::string path = _bvhCacheDir + "/" + name;
 
-  bvhNodes.reserve(scene.tris.size() * 2);
+  if(bvh.load(path, tris, hash, _buildMode, _layout, &threadPool())) return;
 
-  buildBVHRecursive(scene, 0, (int)scene.tris.size());
-  bvhBuilt = true;
+  bvh.build(tris, _buildMode, _layout, &threadPool());
+  if(!bvh.save(path, hash))
+    std::cerr << "[RayTracer] could not write the BVH cache file " << path << std::endl;
 }
 
-int RayTracer::buildBVHRecursive(const RTScene& scene, int start, int count) {
-  int nodeIdx = (int)bvhNodes.size();
-  bvhNodes.push_back(BVHNode());
+void RayTracer::buildBVH(const RTScene& scene) {
+  buildCached(_sceneBVH, scene.tris);
 
-  AABB bounds;
-  AABB centroidBounds;
-  for(int i=0; i<count; ++i) {
-    const RTTriangle& tri = scene.tris[bvhTriIndices[start + i]];
-    bounds = mergeAABB(bounds, triAABB(tri));
+  _meshBVHs.clear();
+  updateInstances(scene);
+}
 
-    glm::vec3 c = triCentroid(tri);
-    AABB cb; cb.bmin = cb.bmax = c;
-    centroidBounds = mergeAABB(centroidBounds, cb);
+void RayTracer::rebuildMesh(const RTScene& scene, int meshId) {
+  if(meshId < 0 || meshId >= (int)scene.meshes.size()) return;
+  if(meshId >= (int)_meshBVHs.size()) {
+    updateInstances(scene);
+    return;
   }
 
-  bvhNodes[nodeIdx].box = bounds;
+  buildCached(_meshBVHs[meshId], scene.meshes[meshId].tris);
 
-  const int LEAF_TRI_COUNT = 4;
-  glm::vec3 ext = centroidBounds.bmax - centroidBounds.bmin;
+  // the instances of this mesh have new bounds
+  updateInstances(scene);
+}
 
-  // leaf conditions
-  if(count <= LEAF_TRI_COUNT || ext.x < 1e-6f && ext.y < 1e-6f && ext.z < 1e-6f) {
-    bvhNodes[nodeIdx].start = start;
-    bvhNodes[nodeIdx].count = count;
-    return nodeIdx;
-  }
+void RayTracer::refitBVH(const RTScene& scene) {
+  _sceneBVH.refit(scene.tris, 1.5f, &threadPool());
 
-  // choose split axis
-  int axis = 0;
-  if(ext.y > ext.x) axis = 1;
-  if(ext.z > ext[axis]) axis = 2;
+  size_t n = std::min(_meshBVHs.size(), scene.meshes.size());
+  for(size_t m=0; m<n; ++m)
+    _meshBVHs[m].refit(scene.meshes[m].tris, 1.5f, &threadPool());
 
-  int mid = start + count/2;
+  updateInstances(scene);
+}
 
-  std::nth_element(
-    bvhTriIndices.begin() + start,
-    bvhTriIndices.begin() + mid,
-    bvhTriIndices.begin() + start + count,
-    [&](int ia, int ib) {
-      return triCentroid(scene.tris[ia])[axis] < triCentroid(scene.tris[ib])[axis];
-    }
-  );
+void RayTracer::refitMesh(const RTScene& scene, int meshId) {
+  if(meshId < 0 || meshId >= (int)scene.meshes.size()) return;
+  if(meshId >= (int)_meshBVHs.size()) {
+    updateInstances(scene);
+    return;
+  }
 
-  int leftCount  = mid - start;
-  int rightCount = count - leftCount;
+  _meshBVHs[meshId].refit(scene.meshes[meshId].tris, 1.5f, &threadPool());
+  updateInstances(scene);
+}
 
-  int left  = buildBVHRecursive(scene, start, leftCount);
-  int right = buildBVHRecursive(scene, mid, rightCount);
+void RayTracer::updateInstances(const RTScene& scene) {
+  // bottom level for meshes added since the last build
+  size_t built = std::min(_meshBVHs.size(), scene.meshes.size());
+  _meshBVHs.resize(scene.meshes.size());
+  for(size_t m=built; m<scene.meshes.size(); ++m)
+    buildCached(_meshBVHs[m], scene.meshes[m].tris);
+
+  _instances.clear();
+  std::vector<RTAABB> boxes;
+  boxes.reserve(scene.instances.size());
+
+  for(const RTInstance& inst : scene.instances) {
+    if(inst.meshId < 0 || inst.meshId >= (int)_meshBVHs.size()) continue;
+    if(_meshBVHs[inst.meshId].empty()) continue;
+
+    InstanceXform xf;
+    xf.meshId = inst.meshId;
+    xf.matId = inst.matId;
+    xf.worldToObject = glm::inverse(inst.transform);
+    xf.normalMat = glm::transpose(glm::inverse(glm::mat3(inst.transform)));
+    _instances.push_back(xf);
+
+    boxes.push_back(transformAABB(_meshBVHs[inst.meshId].bounds(), inst.transform));
+  }
+
+  // the top level is small and only tested with the binary traversal below
+  _topBVH.buildFromBoxes(boxes, _buildMode);
+}
 
-  bvhNodes[nodeIdx].left  = left;
-  bvhNodes[nodeIdx].right = right;
-  bvhNodes[nodeIdx].count = 0; // internal
-  return nodeIdx;
+size_t RayTracer::bvhMemoryBytes(bool traversalOnly) const {
+  auto bytes = [&](const BVH& b) { return traversalOnly ? b.traversalBytes() : b.memoryBytes(); };
+  size_t total = bytes(_sceneBVH) + bytes(_topBVH);
+  for(const BVH& b : _meshBVHs) total += bytes(b);
+  return total;
 }
 
+// world box around the eight transformed corners of b
+RTAABB RayTracer::transformAABB(const RTAABB& b, const glm::mat4& m) {
+  RTAABB o;
+  for(int c=0; c<8; ++c) {
+    glm::vec3 p((c & 1) ? b.bmax.x : b.bmin.x,
+                (c & 2) ? b.bmax.y : b.bmin.y,
+                (c & 4) ? b.bmax.z : b.bmin.z);
+    glm::vec3 w = glm::vec3(m * glm::vec4(p, 1.f));
+    o.bmin = glm::min(o.bmin, w);
+    o.bmax = glm::max(o.bmax, w);
+  }
+  return o;
+}
 
-bool RayTracer::intersectBVH(const RTScene& scene, const glm::vec3& ro, const glm::vec3& rd, Hit& hit, float tMaxLimit) const
+// Walks the top level near-first; at a leaf the ray is moved into the
+// instance's object space and traced against the mesh BVH. The object
+// direction is not renormalized, so t stays a world distance and hits of
+// different instances compare directly.
+bool RayTracer::intersectInstances(const RTRay& ray, RTHit& hit, float tMaxLimit) const
 {
-  if(!bvhBuilt) return false;
-  if(bvhNodes.empty()) return false;
+  if(_topBVH.empty()) return false;
+
+  const BVH::NodeArray& nodes = _topBVH.nodes();
+  RTStats& st = rtThreadStats();
 
   bool any = false;
-  
-  int stack[128];
+  float tMax = std::min(hit.t, tMaxLimit);
+
+  float tEntry;
+  st.boxTests++;
+  if(!BVH::intersectAABB(ray, nodes[0], tMax, tEntry)) return false;
+
+  struct StackEntry {
+    int node;
+    float tEntry;
+  };
+  BVH::TraversalStack<StackEntry> stack(_topBVH.stackSize());
   int sp = 0;
-  stack[sp++] = 0;
+  int ni = 0;
 
-  while(sp) {
-    int ni = stack[--sp];
-    const BVHNode& node = bvhNodes[ni];
+  for(;;) {
+    const BVH::Node& node = nodes[ni];
+    st.nodesVisited++;
+
+    if(node.count > 0) {
+      for(int i=0; i<node.count; ++i) {
+        int inst = _topBVH.primIndex(node.rightOrFirst + i);
+        const InstanceXform& xf = _instances[inst];
+
+        RTRay objRay(glm::vec3(xf.worldToObject * glm::vec4(ray.o, 1.f)),
+                     glm::vec3(xf.worldToObject * glm::vec4(ray.d, 0.f)));
+        if(_meshBVHs[xf.meshId].intersect(objRay, hit, tMax)) {
+          hit.inst = inst;
+          tMax = hit.t;
+          any = true;
+        }
+      }
+    } else {
+      int nearIdx = ni + 1;
+      int farIdx = node.rightOrFirst;
+      float tNear, tFar;
+      bool hitNear = BVH::intersectAABB(ray, nodes[nearIdx], tMax, tNear);
+      bool hitFar  = BVH::intersectAABB(ray, nodes[farIdx], tMax, tFar);
+      st.boxTests += 2;
+
+      if(hitNear && hitFar) {
+        if(tFar < tNear) {
+          std::swap(nearIdx, farIdx);
+          std::swap(tNear, tFar);
+        }
+        stack[sp].node = farIdx;
+        stack[sp].tEntry = tFar;
+        ++sp;
+        ni = nearIdx;
+        continue;
+      }
+      if(hitNear) { ni = nearIdx; continue; }
+      if(hitFar)  { ni = farIdx;  continue; }
+    }
 
-    float tmin, tmax;
-    if(!intersectAABB(ro, rd, node.box, tmin, tmax)) continue;
-    if(tmin > hit.t) continue;
-    if(tmin > tMaxLimit) continue;
+    while(sp && stack[sp-1].tEntry > tMax) --sp;
+    if(!sp) break;
+    ni = stack[--sp].node;
+  }
+
+  return any;
+}
+
+// intersectInstances() for a packet: the top level is walked once, every
+// node entered with the first ray that hits it, and at a leaf the rays from
+// there on are moved to the instance's object space and traced as a packet
+// against the mesh BVH.
+uint32_t RayTracer::intersectInstancesPacket(const RTRay* rays, int count, RTHit* hits, float tMaxLimit) const
+{
+  assert(count <= BVH::MAX_PACKET);
+  if(_topBVH.empty()) return 0;
+
+  const BVH::NodeArray& nodes = _topBVH.nodes();
+  RTStats& st = rtThreadStats();
+
+  // first ray from `from` on that enters box, count when none
+  auto firstHit = [&](const BVH::Node& box, int from, float& tEntry) {
+    for(int r=from; r<count; ++r) {
+      st.boxTests++;
+      if(BVH::intersectAABB(rays[r], box, std::min(hits[r].t, tMaxLimit), tEntry)) return r;
+    }
+    return count;
+  };
+
+  uint32_t any = 0;
+  float tEntry;
+  int first = firstHit(nodes[0], 0, tEntry);
+  if(first == count) return 0;
+
+  struct StackEntry {
+    int node;
+    int first;
+  };
+  BVH::TraversalStack<StackEntry> stack(_topBVH.stackSize());
+  int sp = 0;
+  int ni = 0;
+
+  for(;;) {
+    const BVH::Node& node = nodes[ni];
+    st.nodesVisited += count - first;
 
     if(node.count > 0) {
-        
+      RTRay objRays[BVH::MAX_PACKET];
       for(int i=0; i<node.count; ++i) {
-        const RTTriangle& tri = scene.tris[bvhTriIndices[node.start + i]];
-        float t, u, v;
-        if(intersectTriangle(ro, rd, tri, t, u, v)) {
-          if(t < hit.t && t < tMaxLimit) {
-            any = true;
-            hit.t = t;
-            hit.p = ro + t * rd;
-            float w = 1.0f - u - v;
-            hit.uv = w*tri.uv0 + u*tri.uv1 + v*tri.uv2;
-            glm::vec3 n = w*tri.n0 + u*tri.n1 + v*tri.n2;
-            hit.n = glm::normalize(n);
-            hit.matId = tri.matId;
+        int inst = _topBVH.primIndex(node.rightOrFirst + i);
+        const InstanceXform& xf = _instances[inst];
+
+        for(int r=first; r<count; ++r)
+          objRays[r - first] = RTRay(glm::vec3(xf.worldToObject * glm::vec4(rays[r].o, 1.f)),
+                                     glm::vec3(xf.worldToObject * glm::vec4(rays[r].d, 0.f)));
+        uint32_t hit = _meshBVHs[xf.meshId].intersectPacket(objRays, count - first, hits + first, tMaxLimit);
+        for(int r=first; r<count; ++r)
+          if(hit & (1u << (r - first))) {
+            hits[r].inst = inst;
+            any |= 1u << r;
           }
-        }
       }
     } else {
-      if(node.left  >= 0) stack[sp++] = node.left;
-      if(node.right >= 0) stack[sp++] = node.right;
+      int nearIdx = ni + 1;
+      int farIdx = node.rightOrFirst;
+      float tNear, tFar;
+      int firstNear = firstHit(nodes[nearIdx], first, tNear);
+      int firstFar  = firstHit(nodes[farIdx], first, tFar);
+
+      if(firstNear < count && firstFar < count) {
+        if(tFar < tNear) {
+          std::swap(nearIdx, farIdx);
+          std::swap(firstNear, firstFar);
+        }
+        stack[sp].node = farIdx;
+        stack[sp].first = firstFar;
+        ++sp;
+        ni = nearIdx;
+        first = firstNear;
+        continue;
+      }
+      if(firstNear < count) { ni = nearIdx; first = firstNear; continue; }
+      if(firstFar < count)  { ni = farIdx;  first = firstFar;  continue; }
     }
+
+    if(!sp) break;
+    --sp;
+    ni = stack[sp].node;
+    first = stack[sp].first;
   }
 
   return any;
 }
 
+bool RayTracer::occludedInstances(const RTRay& ray, float tMax) const
+{
+  if(_topBVH.empty()) return false;
+
+  const BVH::NodeArray& nodes = _topBVH.nodes();
+  RTStats& st = rtThreadStats();
+
+  float tEntry;
+  st.boxTests++;
+  if(!BVH::intersectAABB(ray, nodes[0], tMax, tEntry)) return false;
+
+  BVH::TraversalStack<int> stack(_topBVH.stackSize());
+  int sp = 0;
+  stack[sp++] = 0;
+
+  while(sp) {
+    int ni = stack[--sp];
+    const BVH::Node& node = nodes[ni];
+    st.nodesVisited++;
+
+    if(node.count > 0) {
+      for(int i=0; i<node.count; ++i) {
+        const InstanceXform& xf = _instances[_topBVH.primIndex(node.rightOrFirst + i)];
+        RTRay objRay(glm::vec3(xf.worldToObject * glm::vec4(ray.o, 1.f)),
+                     glm::vec3(xf.worldToObject * glm::vec4(ray.d, 0.f)));
+        if(_meshBVHs[xf.meshId].occluded(objRay, tMax)) return true;
+      }
+      continue;
+    }
+
+    int left = ni + 1;
+    int right = node.rightOrFirst;
+    st.boxTests += 2;
+    if(BVH::intersectAABB(ray, nodes[right], tMax, tEntry)) stack[sp++] = right;
+    if(BVH::intersectAABB(ray, nodes[left], tMax, tEntry))  stack[sp++] = left;
+  }
+
+  return false;
+}
+
 glm::vec3 RayTracer::background(const glm::vec3& rd) const {
   if(_env) return _env->sample(rd);
 
@@ -1,59 +1,174 @@
 #pragma once
 #include <glm/glm.hpp>
+#include <cstdint>
 #include <vector>
 #include <string>
+#include <memory>
+#include <atomic>
+#include <functional>
 #include "EnvMap.h"
 #include "Texture2D.h"
+#include "ThreadPool.h"
+#include "RTScene.h"
+#include "BVH.h"
 
 
 
-struct RTMaterial {
-  glm::vec3 albedo = glm::vec3(0.8f);
-  bool useTexture = false;
-  int texId = -1;
-  bool shadowCatcher = true;
-};
+class EnvMap;
 
-struct RTTriangle {
-  glm::vec3 p0, p1, p2;
-  glm::vec3 n0, n1, n2;
-  glm::vec2 uv0, uv1, uv2;
-  int matId = 0;
-};
+// Progressive rendering state: per pixel sums of the samples taken so far,
+// per tile sample count and convergence. Reset it when the camera or the
+// scene changes.
+struct RTAccumBuffer {
+  static const int MIN_SAMPLES = 4; // before a tile may count as converged
 
-struct RTScene {
-  std::vector<RTTriangle> tris;
-  std::vector<RTMaterial> mats;
-  std::vector<Texture2D> textures;
-};
+  int w = 0, h = 0;
+  int tilesX = 0, tilesY = 0;
+  int passes = 0;
+
+  std::vector<glm::vec3> sum;      // per pixel
+  std::vector<float> lumSqSum;     // per pixel, sum of squared luminance
+  std::vector<int> tileSamples;    // per tile
+  std::vector<float> tileError;    // per tile, relative standard error of the mean
+  std::vector<char> tileConverged; // per tile
+
+  void reset(int width, int height, int tileSize);
 
-struct RTCamera {
-  glm::vec3 pos;
-  glm::mat4 invView;
-  float fovYDegrees = 45.f;
-  float aspect = 1.f;
+  // average of the samples so far
+  glm::vec3 pixel(int x, int y) const;
+
+  int activeTiles() const;
 };
 
-struct RTLight {
-  glm::vec3 position;
-  glm::vec3 color = glm::vec3(1.f);
-  float intensity = 1.f;
+// Lighting of a surface point by the point light, split on the light's
+// visibility (0 in shadow, 1 lit)
+struct RTSurfaceLight {
+  glm::vec3 ambient;
+  glm::vec3 direct;
+
+  glm::vec3 shade(float vis) const { return ambient + direct * vis; }
 };
 
-class EnvMap;
+// How a tile is traced. Both give the same image.
+enum class RTPipeline {
+  PerPixel, // generate, intersect, shade and shadow test one pixel at a time
+  Wavefront // each stage runs over the whole tile's rays in SoA queues
+};
 
 class RayTracer {
 public:
-  RayTracer(int w, int h) : _w(w), _h(h) {}
+  RayTracer(int w, int h);
 
   std::vector<glm::vec3> render(const RTScene& scene, const RTCamera& cam, const RTLight& light) const;
 
-  static void savePPM(const std::string& filename, const std::vector<glm::vec3>& pixels, int w, int h);
+  // Called on a worker thread as soon as the pixels [x0,x1) x [y0,y1) of
+  // the image are final
+  typedef std::function<void(int x0, int y0, int x1, int y1)> TileCallback;
+
+  // Progressive variant: img is resized to w*h, onTile reports each
+  // finished tile, and tiles not started yet are skipped once *cancel is
+  // set (the image is then incomplete).
+  void render(const RTScene& scene, const RTCamera& cam, const RTLight& light,
+              std::vector<glm::vec3>& img, const TileCallback& onTile,
+              const std::atomic<bool>* cancel) const;
+
+  // Adds one jittered sample to every pixel of the tiles of acc that have
+  // not converged yet (the first pass samples the pixel centers). A tile
+  // converges once its relative error drops below errorThreshold. Returns
+  // the number of tiles still taking samples.
+  int renderPass(const RTScene& scene, const RTCamera& cam, const RTLight& light,
+                 RTAccumBuffer& acc, const TileCallback& onTile,
+                 const std::atomic<bool>* cancel, float errorThreshold = 0.01f) const;
+
+  // Single queries against the built BVHs, no shading: only t, u, v, prim
+  // and inst of the hit are set. They trace the scene of the last
+  // buildBVH()/updateInstances(), which the BVHs hold.
+  bool intersect(const RTRay& ray, RTHit& hit, float tMax = 1e30f) const {
+    return intersectScene(ray, hit, tMax);
+  }
+  bool occluded(const RTRay& ray, float tMax) const {
+    return occludedScene(ray, tMax);
+  }
 
+  // intersect() for coherent rays, traced as packets of BVH::MAX_PACKET
+  // rays, see BVH::intersectPacket(). Returns the number of rays that hit.
+  int intersectPacket(const RTRay* rays, int count, RTHit* hits, float tMax = 1e30f) const;
+
+  // occluded() for a batch of rays, on the calling thread: occluded[i] for
+  // rays[i] and tMax[i]. With binned, the rays are traced in
+  // coherentRayOrder() (Morton.h) instead of the order given, which only
+  // changes how many BVH nodes the batch visits, not the results.
+  void occludedBatch(const std::vector<RTRay>& rays, const std::vector<float>& tMax, std::vector<char>& occluded,
+                     bool binned = true) const;
+
+  static int tileSize() { return TILE_SIZE; }
+
+  int width() const { return _w; }
+  int height() const { return _h; }
+
+  // Binary PPM with exposure, Reinhard and gamma 2.2 (see PPMWriter);
+  // false if the file could not be written
+  static bool savePPM(const std::string& filename, const std::vector<glm::vec3>& pixels, int w, int h, float exposure = 1.0f);
+
+  // Builds the BVH of scene.tris, one bottom-level BVH per scene.meshes
+  // entry (in object space) and the top-level BVH over scene.instances.
   void buildBVH(const RTScene& scene);
 
+  // Instances were moved, added or removed: only the top level is rebuilt
+  // (plus the bottom level of meshes that were added since the last build).
+  void updateInstances(const RTScene& scene);
+
+  // The triangles of scene.meshes[meshId] changed
+  void rebuildMesh(const RTScene& scene, int meshId);
+
+  // Vertices moved but the triangles are the same (e.g. after smoothing):
+  // refits the BVHs in linear time, falling back to a rebuild for any tree
+  // whose quality dropped too far.
+  void refitBVH(const RTScene& scene);
+  void refitMesh(const RTScene& scene, int meshId);
+
+  // Used by every later build or rebuild: LBVH builds several times
+  // faster, SAH gives the fastest traversal
+  void setBVHBuildMode(BVHBuildMode mode) { _buildMode = mode; }
+
+  // Takes effect at the next buildBVH()
+  void setBVHLayout(BVHLayout layout) { _layout = layout; }
+
+  // Memory of the built BVHs (scene, meshes and top level), see
+  // BVH::memoryBytes(); with traversalOnly what the traversal reads
+  size_t bvhMemoryBytes(bool traversalOnly = false) const;
+
+  // Directory (which must exist) of BVH cache files, empty to disable.
+  // Builds of the scene and mesh BVHs first look for a file matching the
+  // content hash of their triangles, the build mode and the layout, and
+  // write one after building when there is none.
+  void setBVHCacheDir(const std::string& dir) { _bvhCacheDir = dir; }
+
   void setEnvMap(const EnvMap* env) { _env = env; }
 
+  // Number of threads used by render() and the BVH builds; 0 uses every
+  // hardware thread. Neither the image nor the BVHs depend on this value.
+  // Replaces the pool when the count changes, which invalidates the
+  // references threadPool() returned before.
+  void setThreadCount(int n);
+
+  // The pool for setThreadCount() threads, also there for the scene setup
+  // (RTSceneBuilder) to share
+  ThreadPool& threadPool() const { return *_pool; }
+
+  const RTStats& stats() const { return _stats; }
+
+  void setPipeline(RTPipeline p) { _pipeline = p; }
+
+  // Trace the camera rays of both pipelines in PACKET_SIZE^2 pixel packets
+  // (the default) or one by one. The image is the same.
+  void setPrimaryPackets(bool on) { _primaryPackets = on; }
+
+  static const int PACKET_SIZE = 4;
+
+  // Shadow catching ground plane at height y: the background darkened by
+  // strength where the light is blocked. No plane while matId < 0 (the
+  // default).
   void setGround(float y, int matId, float strength=0.6f) {
     groundY = y;
     groundMatId = matId;
@@ -66,59 +181,96 @@ private:
 
   const EnvMap* _env = nullptr;
 
-  float groundY = -0.55f;
-  int groundMatId = -1;
-  float shadowStrength = 0.6f;
-
+  static const int TILE_SIZE = 16;
+  RTPipeline _pipeline = RTPipeline::PerPixel;
+  bool _primaryPackets = true;
+  int _threadCount = 0;
+  std::shared_ptr<ThreadPool> _pool;
 
-  struct Hit {
-    float t = 1e30f;
-    glm::vec3 p;
-    glm::vec3 n;
-    glm::vec2 uv;
-    int matId = -1;
-  };
+  int resolvedThreadCount() const;
 
-  static bool intersectTriangle(const glm::vec3& ro, const glm::vec3& rd, const RTTriangle& tri, float& t, float& u, float& v);
+  std::string _bvhCacheDir;
 
-  bool intersectScene(const RTScene& scene, const glm::vec3& ro, const glm::vec3& rd, Hit& hit, float tMaxLimit) const;
+  // bvh.build(), through the cache when there is one
+  void buildCached(BVH& bvh, const RTGeometry& tris);
 
-  // static bool intersectPlaneY(const glm::vec3& ro, const glm::vec3& rd, float y, float& tOut);
-  
+  // fn(tile, x0, y0, x1, y1) for every tile, spread over the pool
+  void runTiles(const std::function<void(int tile, int x0, int y0, int x1, int y1)>& fn,
+                const std::atomic<bool>* cancel) const;
 
-  bool intersectBVH(const RTScene& scene, const glm::vec3& ro, const glm::vec3& rd, Hit& hit, float tMaxLimit) const;
+  mutable RTStats _stats;
 
-  glm::vec3 background(const glm::vec3& rd) const;
+  float groundY = -0.55f;
+  int groundMatId = -1;
+  float shadowStrength = 0.6f;
 
-  bool isOccluded(const RTScene& scene, const glm::vec3& p, const glm::vec3& n, const glm::vec3& lightPos) const;
 
-  struct AABB {
-    glm::vec3 bmin = glm::vec3( 1e30f);
-    glm::vec3 bmax = glm::vec3(-1e30f);
-  };
+  bool intersectScene(const RTRay& ray, RTHit& hit, float tMaxLimit) const;
+  void finalizeHit(const RTScene& scene, const RTRay& ray, RTHit& hit) const;
 
-  struct BVHNode {
-    AABB box;
-    int left = -1;
-    int right = -1;
-    int start = 0;   
-    int count = 0;   
-  };
+  static bool intersectPlaneY(const glm::vec3& ro, const glm::vec3& rd, float y, float& tOut);
 
-  mutable std::vector<BVHNode> bvhNodes;
-  mutable std::vector<int> bvhTriIndices;
-  mutable bool bvhBuilt = false;
 
-  static AABB triAABB(const RTTriangle& t);
-  static AABB mergeAABB(const AABB& a, const AABB& b);
-  static glm::vec3 triCentroid(const RTTriangle& t);
+  // any-hit query: true as soon as one triangle is hit before tMax
+  bool occludedScene(const RTRay& ray, float tMax) const;
 
-  static bool intersectAABB(const glm::vec3& ro, const glm::vec3& rd, const AABB& box, float& tminOut, float& tmaxOut);
+  bool intersectInstances(const RTRay& ray, RTHit& hit, float tMax) const;
+  bool occludedInstances(const RTRay& ray, float tMax) const;
 
+  // packet versions of intersectScene() and intersectInstances(), for at
+  // most BVH::MAX_PACKET rays; they return the mask of the rays whose hit
+  // was set
+  uint32_t intersectScenePacket(const RTRay* rays, int count, RTHit* hits, float tMaxLimit) const;
+  uint32_t intersectInstancesPacket(const RTRay* rays, int count, RTHit* hits, float tMaxLimit) const;
 
+  glm::vec3 background(const glm::vec3& rd) const;
 
-  int buildBVHRecursive(const RTScene& scene, int start, int count);
-  
-  
+  glm::vec3 tracePixel(const RTScene& scene, const RTCamera& cam, const RTLight& light, float tanHalf, float sx, float sy) const;
+
+  // the two halves of tracePixel(): the camera ray through (sx, sy), and
+  // the color of that ray given its closest scene hit
+  RTRay primaryRay(const RTCamera& cam, float tanHalf, float sx, float sy) const;
+  glm::vec3 shadePrimary(const RTScene& scene, const RTLight& light, const RTRay& ray, bool hitScene, const RTHit& hitTri) const;
+
+  // the lighting both pipelines share: the ground plane over its
+  // background bg, and a surface point
+  glm::vec3 shadeGround(const glm::vec3& bg, float vis) const;
+  RTSurfaceLight surfaceLight(const RTScene& scene, const RTLight& light, const glm::vec3& p, const glm::vec3& n,
+                              const glm::vec2& uv, int matId) const;
+
+  // Sample position inside pixel (x, y) for a pass: the center for pass 0,
+  // jittered after that
+  static void sampleOffset(int x, int y, uint32_t pass, float& jx, float& jy);
+
+  // One sample of every pixel of the tile into out (tile rows, x1-x0 wide),
+  // through the selected pipeline
+  void traceTile(const RTScene& scene, const RTCamera& cam, const RTLight& light, float tanHalf,
+                 int x0, int y0, int x1, int y1, uint32_t pass, glm::vec3* out) const;
+  void traceTileWavefront(const RTScene& scene, const RTCamera& cam, const RTLight& light, float tanHalf,
+                          int x0, int y0, int x1, int y1, uint32_t pass, glm::vec3* out) const;
+
+  // ray from surface point p (normal n) towards the light, and the
+  // distance up to which it is tested
+  static RTRay shadowRay(const glm::vec3& p, const glm::vec3& n, const glm::vec3& lightPos, float& tMax);
+  bool isOccluded(const glm::vec3& p, const glm::vec3& n, const glm::vec3& lightPos) const;
+
+  BVHBuildMode _buildMode = BVHBuildMode::SAH;
+  BVHLayout _layout = BVHLayout::Wide4;
+
+  // Two levels: scene.tris has its own BVH; every mesh has a bottom-level
+  // BVH in object space, and the top level is a BVH over instance bounds.
+  BVH _sceneBVH;
+  std::vector<BVH> _meshBVHs;
+  BVH _topBVH;
+
+  // per instance, captured when the top level is built
+  struct InstanceXform {
+    int meshId = -1;
+    int matId = -1;
+    glm::mat4 worldToObject;
+    glm::mat3 normalMat;
+  };
+  std::vector<InstanceXform> _instances;
 
+  static RTAABB transformAABB(const RTAABB& b, const glm::mat4& m);
 };
@@ -0,0 +1,256 @@
+#include "RayTracer.h"
+#include "Morton.h"
+
+#include <algorithm>
+#include <cmath>
+
+// Wavefront pipeline: the rays of a tile go through the stages one stage at
+// a time instead of one pixel at a time. Every stage is a loop over
+// structure-of-arrays queues, and surface hits are shaded in material order.
+// The arithmetic is the same as tracePixel()'s, so both pipelines produce
+// identical images.
+//
+//   generate  camera rays for every pixel of the tile
+//   extend    closest hit of every ray, traced in pixel packets, split into
+//             miss / ground / surface
+//   shade     background for misses; ground and (sorted by matId) surface
+//             shading through the per-pixel pipeline's shadeGround() and
+//             surfaceLight(), each emitting a shadow ray with its lit and
+//             unlit color
+//   connect   any-hit test of the shadow rays, picking lit or unlit
+
+namespace {
+
+struct RayQueue {
+  std::vector<float> ox, oy, oz;
+  std::vector<float> dx, dy, dz;
+  std::vector<float> tMax;
+  std::vector<int> pixel; // tile-local pixel the ray contributes to
+  int size = 0;
+
+  void reset(int capacity) {
+    size = 0;
+    if ((int)pixel.size() >= capacity) return;
+    ox.resize(capacity); oy.resize(capacity); oz.resize(capacity);
+    dx.resize(capacity); dy.resize(capacity); dz.resize(capacity);
+    tMax.resize(capacity);
+    pixel.resize(capacity);
+  }
+
+  int push(const glm::vec3& o, const glm::vec3& d, float t, int px) {
+    int i = size++;
+    ox[i] = o.x; oy[i] = o.y; oz[i] = o.z;
+    dx[i] = d.x; dy[i] = d.y; dz[i] = d.z;
+    tMax[i] = t;
+    pixel[i] = px;
+    return i;
+  }
+
+  glm::vec3 origin(int i) const { return glm::vec3(ox[i], oy[i], oz[i]); }
+  glm::vec3 dir(int i) const { return glm::vec3(dx[i], dy[i], dz[i]); }
+};
+
+// Surface hits, resolved to their shading attributes
+struct SurfaceQueue {
+  std::vector<int> ray;                   // index into the primary queue
+  std::vector<float> px, py, pz;          // hit point
+  std::vector<float> nx, ny, nz;          // world normal
+  std::vector<float> u, v;                // texture coordinates
+  std::vector<int> matId;
+  int size = 0;
+
+  void reset(int capacity) {
+    size = 0;
+    if ((int)ray.size() >= capacity) return;
+    ray.resize(capacity);
+    px.resize(capacity); py.resize(capacity); pz.resize(capacity);
+    nx.resize(capacity); ny.resize(capacity); nz.resize(capacity);
+    u.resize(capacity); v.resize(capacity);
+    matId.resize(capacity);
+  }
+};
+
+// Per-thread queues, reused from tile to tile
+struct WavefrontQueues {
+  RayQueue primary;
+  std::vector<RTHit> hits;           // closest hit per primary ray
+  std::vector<float> groundT;        // per primary ray, ground plane distance
+  std::vector<int> ground;           // primary rays that hit the ground first
+  SurfaceQueue surface;
+  std::vector<int> order;            // surface entries sorted by matId
+  std::vector<int> matCount;
+  RayQueue shadow;
+  std::vector<glm::vec3> lit, unlit; // per shadow ray
+
+  void reset(int n) {
+    primary.reset(n);
+    shadow.reset(n);
+    surface.reset(n);
+    hits.resize(n);
+    groundT.resize(n);
+    ground.clear();
+    order.resize(n);
+    lit.resize(n);
+    unlit.resize(n);
+  }
+};
+
+WavefrontQueues& threadQueues() {
+  static thread_local WavefrontQueues q;
+  return q;
+}
+
+} // namespace
+
+void RayTracer::traceTileWavefront(const RTScene& scene, const RTCamera& cam, const RTLight& light, float tanHalf,
+                                   int x0, int y0, int x1, int y1, uint32_t pass, glm::vec3* out) const {
+  const int tw = x1 - x0;
+  const int n = tw * (y1 - y0);
+
+  WavefrontQueues& q = threadQueues();
+  q.reset(n);
+
+  // generate
+  RayQueue& prim = q.primary;
+  for (int i = 0; i < n; ++i) {
+    int x = x0 + i % tw;
+    int y = y0 + i / tw;
+    float jx, jy;
+    sampleOffset(x, y, pass, jx, jy);
+
+    RTRay ray = primaryRay(cam, tanHalf, x + jx, y + jy);
+    prim.push(ray.o, ray.d, 1e30f, i);
+  }
+
+  // extend, the camera rays in PACKET_SIZE^2 pixel packets
+  const int th = y1 - y0;
+  for (int by = 0; by < th; by += PACKET_SIZE)
+    for (int bx = 0; bx < tw; bx += PACKET_SIZE) {
+      int ex = std::min(bx + PACKET_SIZE, tw), ey = std::min(by + PACKET_SIZE, th);
+
+      int idx[PACKET_SIZE * PACKET_SIZE];
+      RTRay rays[PACKET_SIZE * PACKET_SIZE];
+      RTHit hits[PACKET_SIZE * PACKET_SIZE];
+      int n = 0;
+      for (int y = by; y < ey; ++y)
+        for (int x = bx; x < ex; ++x) {
+          int i = y * tw + x;
+          idx[n] = i;
+          rays[n++] = RTRay(prim.origin(i), prim.dir(i));
+        }
+
+      uint32_t hitMask = 0;
+      if (_primaryPackets) {
+        hitMask = intersectScenePacket(rays, n, hits, 1e30f);
+      } else {
+        for (int k = 0; k < n; ++k)
+          if (intersectScene(rays[k], hits[k], prim.tMax[idx[k]])) hitMask |= 1u << k;
+      }
+
+      for (int k = 0; k < n; ++k) {
+        int i = idx[k];
+        const glm::vec3& ro = rays[k].o;
+        const glm::vec3& rd = rays[k].d;
+        q.hits[i] = hits[k];
+        bool hitScene = (hitMask >> k) & 1u;
+
+        float tPlane;
+        bool hitPlane = groundMatId >= 0 && intersectPlaneY(ro, rd, groundY, tPlane);
+
+        if (!hitScene && !hitPlane) {
+          out[prim.pixel[i]] = background(rd);
+        } else if (hitPlane && (!hitScene || tPlane < hits[k].t)) {
+          q.groundT[i] = tPlane;
+          q.ground.push_back(i);
+        } else {
+          q.surface.ray[q.surface.size++] = i;
+        }
+      }
+    }
+
+  // resolve the surface hits, then bucket them by material
+  SurfaceQueue& surf = q.surface;
+  q.matCount.assign(scene.mats.size() + 1, 0);
+  for (int k = 0; k < surf.size; ++k) {
+    int i = surf.ray[k];
+    RTHit& hit = q.hits[i];
+    finalizeHit(scene, RTRay(prim.origin(i), prim.dir(i)), hit);
+
+    surf.px[k] = hit.p.x; surf.py[k] = hit.p.y; surf.pz[k] = hit.p.z;
+    surf.nx[k] = hit.n.x; surf.ny[k] = hit.n.y; surf.nz[k] = hit.n.z;
+    surf.u[k] = hit.uv.x; surf.v[k] = hit.uv.y;
+    surf.matId[k] = hit.matId;
+    q.matCount[hit.matId + 1]++;
+  }
+  for (size_t m = 1; m < q.matCount.size(); ++m) q.matCount[m] += q.matCount[m - 1];
+  for (int k = 0; k < surf.size; ++k) q.order[q.matCount[surf.matId[k]]++] = k;
+
+  // shade
+  RayQueue& shadow = q.shadow;
+  auto emitShadow = [&](const glm::vec3& p, const glm::vec3& nrm, int pixel) {
+    float tMax;
+    RTRay ray = shadowRay(p, nrm, light.position, tMax);
+    return shadow.push(ray.o, ray.d, tMax, pixel);
+  };
+
+  for (int i : q.ground) {
+    glm::vec3 rd = prim.dir(i);
+    glm::vec3 bg = background(rd);
+    if (rd.y >= 0.0f) {
+      out[prim.pixel[i]] = bg;
+      continue;
+    }
+
+    glm::vec3 p = prim.origin(i) + q.groundT[i] * rd;
+    int s = emitShadow(p, glm::vec3(0, 1, 0), prim.pixel[i]);
+    q.unlit[s] = shadeGround(bg, 0.0f);
+    q.lit[s]   = shadeGround(bg, 1.0f);
+  }
+
+  for (int j = 0; j < surf.size; ++j) {
+    int k = q.order[j];
+    glm::vec3 p(surf.px[k], surf.py[k], surf.pz[k]);
+    glm::vec3 nrm(surf.nx[k], surf.ny[k], surf.nz[k]);
+    RTSurfaceLight sl = surfaceLight(scene, light, p, nrm, glm::vec2(surf.u[k], surf.v[k]), surf.matId[k]);
+
+    int s = emitShadow(p, nrm, prim.pixel[surf.ray[k]]);
+    q.unlit[s] = sl.shade(0.f);
+    q.lit[s]   = sl.shade(1.f);
+  }
+
+  // connect
+  for (int s = 0; s < shadow.size; ++s) {
+    bool occ = occludedScene(RTRay(shadow.origin(s), shadow.dir(s)), shadow.tMax[s]);
+    out[shadow.pixel[s]] = occ ? q.unlit[s] : q.lit[s];
+  }
+}
+
+void RayTracer::occludedBatch(const std::vector<RTRay>& rays, const std::vector<float>& tMax, std::vector<char>& occluded,
+                              bool binned) const {
+  const int n = (int)rays.size();
+  occluded.resize(n);
+
+  if (!binned) {
+    for (int i = 0; i < n; ++i) occluded[i] = occludedScene(rays[i], tMax[i]);
+    return;
+  }
+
+  RayQueue q;
+  q.reset(n);
+  for (int i = 0; i < n; ++i) q.push(rays[i].o, rays[i].d, tMax[i], i);
+
+  std::vector<int> order;
+  coherentRayOrder(q.ox.data(), q.oy.data(), q.oz.data(), q.dx.data(), q.dy.data(), q.dz.data(), n, order);
+
+  // gather the rays in that order first: the loads do not wait on each
+  // other there, in the traversal loop each would stall a ray
+  std::vector<RTRay> sorted;
+  std::vector<float> sortedTMax(n);
+  sorted.reserve(n);
+  for (int k = 0; k < n; ++k) {
+    sorted.push_back(rays[order[k]]);
+    sortedTMax[k] = tMax[order[k]];
+  }
+
+  for (int k = 0; k < n; ++k) occluded[order[k]] = occludedScene(sorted[k], sortedTMax[k]);
+}
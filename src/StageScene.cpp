@@ -0,0 +1,132 @@
+#include "StageScene.h"
+#include "RTSceneBuilder.h"
+
+#include <glm/ext.hpp>
+
+StageTransforms stageTransforms() {
+  StageTransforms xf;
+
+  glm::vec3 Stage_Position(-0.05f, -0.55f, -5.5f);
+  glm::vec3 Full_Object_Scale(0.129f);
+
+  glm::mat4 stageTranslate = glm::translate(glm::mat4(1.0f), Stage_Position);
+  glm::mat4 stageRotate = glm::rotate(glm::mat4(1.0f), glm::radians(-35.0f), glm::vec3(0,1,0));
+  glm::mat4 stageScale = glm::scale(glm::mat4(1.0f), Full_Object_Scale);
+
+  xf.stageMat =
+      stageTranslate *
+      stageRotate *
+      stageScale;
+
+  glm::vec3 Wall_Position = Stage_Position + glm::vec3(0.0f, 0.05f, 0.0f);
+  glm::mat4 wallTranslate = glm::translate(glm::mat4(1.0f), Wall_Position);
+
+  xf.backRockMat =
+      wallTranslate *
+      stageRotate *
+      stageScale;
+
+  glm::mat4 rockScale = glm::scale(glm::mat4(1.0f), glm::vec3(0.2f));
+  xf.rockMat1 = stageTranslate * glm::translate(glm::mat4(1.0f), glm::vec3(-0.2f, -0.7f, 1.8f)) * rockScale;
+  xf.rockMat2 = stageTranslate * glm::translate(glm::mat4(1.0f), glm::vec3(-1.2f, -0.7f, 2.0f)) * rockScale;
+  xf.rockMat3 = stageTranslate * glm::translate(glm::mat4(1.0f), glm::vec3(-0.2f, -10.7f, 1.5f)) * rockScale;
+
+  glm::mat4 frogRotate = glm::rotate(glm::mat4(1.0f), glm::radians(-125.0f), glm::vec3(0,1,0));
+
+  xf.frogMat = stageTranslate * glm::translate(glm::mat4(1.0f), glm::vec3(-1.2f, -0.46f, 1.95f)) * frogRotate * glm::scale(glm::mat4(1.0f), glm::vec3(0.015f));
+
+  return xf;
+}
+
+int addRTInstance(RTScene& rt, int meshId, const glm::mat4& modelMat){
+  RTInstance inst;
+  inst.meshId = meshId;
+  inst.transform = modelMat;
+  rt.instances.push_back(inst);
+  return (int)rt.instances.size() - 1;
+}
+
+StageRTIds buildStageRTScene(RTScene& rt, const Mesh& backRock, const Mesh& stage, const Mesh& rock, const Mesh& frog, const StageTransforms& xf,
+                              ThreadPool* pool){
+  StageRTIds ids;
+
+  rt.mats.clear();
+  rt.textures.clear();
+
+  int texWall = (int)rt.textures.size();
+  rt.textures.push_back(Texture2D());
+  rt.textures.back().load("data/rock_back_texture.png", true);
+
+  int texStage = (int)rt.textures.size();
+  rt.textures.push_back(Texture2D());
+  rt.textures.back().load("data/wood_table_diff_2k.jpg", true);
+
+  // Rock
+  int matRock = (int)rt.mats.size();
+  rt.mats.push_back(RTMaterial());
+  rt.mats.back().albedo = glm::vec3(0.65f);
+  rt.mats.back().shadowCatcher = false;
+  rt.mats.back().useTexture = false;
+  rt.mats.back().texId = -1;
+
+  // Backwall
+  int matWall = (int)rt.mats.size();
+  rt.mats.push_back(RTMaterial());
+  rt.mats.back().albedo = glm::vec3(1.0f);
+  rt.mats.back().shadowCatcher = false;
+  rt.mats.back().useTexture = true;
+  rt.mats.back().texId = texWall;
+
+  // Stage
+  int matStage = (int)rt.mats.size();
+  rt.mats.push_back(RTMaterial());
+  rt.mats.back().albedo = glm::vec3(1.0f);
+  rt.mats.back().shadowCatcher = false;
+  rt.mats.back().useTexture = true;
+  rt.mats.back().texId = texStage;
+
+  // Frog
+  ids.matFrog = (int)rt.mats.size();
+  rt.mats.push_back(RTMaterial());
+  rt.mats.back().albedo = glm::vec3(0.35f, 0.95f, 0.35f);
+  rt.mats.back().shadowCatcher = false;
+  rt.mats.back().useTexture = false;
+  rt.mats.back().texId = -1;
+
+  // ground
+  ids.matGround = (int)rt.mats.size();
+  rt.mats.push_back(RTMaterial());
+  rt.mats.back().albedo = glm::vec3(1.0f);
+  rt.mats.back().shadowCatcher = true;
+  rt.mats.back().useTexture = false;
+  rt.mats.back().texId = -1;
+
+  RTSceneBuilder builder(rt);
+  builder.appendStatic(backRock, xf.backRockMat, matWall);
+  builder.appendStatic(stage, xf.stageMat, matStage);
+
+  // the rocks share one mesh, the frog is instanced so it can move
+  // without touching the rest of the scene
+  int rockMesh = builder.addMesh(rock, matRock);
+  ids.rockInst1 = addRTInstance(rt, rockMesh, xf.rockMat1);
+  ids.rockInst2 = addRTInstance(rt, rockMesh, xf.rockMat2);
+  ids.frogMesh = builder.addMesh(frog, ids.matFrog);
+  ids.frogInst = addRTInstance(rt, ids.frogMesh, xf.frogMat);
+
+  builder.build(pool);
+
+  return ids;
+}
+
+RTLight stageRTLight(const RTCamera& cam){
+  glm::mat4 invV = cam.invView;
+  glm::vec3 right = glm::vec3(invV[0]);
+  glm::vec3 up = glm::vec3(invV[1]);
+  glm::vec3 forward = -glm::vec3(invV[2]);
+
+  RTLight L;
+  L.position  = cam.pos + (-1.5f)*right + (3.0f)*up + (3.0f)*forward;
+  L.color     = glm::vec3(1.f);
+  L.intensity = 15.0f;
+  return L;
+}
@@ -0,0 +1,44 @@
+#pragma once
+#include <glm/glm.hpp>
+#include "Mesh.h"
+#include "RTScene.h"
+
+class ThreadPool;
+
+// The frog stage: object placement, ray tracing materials and light. Shared
+// by the interactive viewer and the batch renderer.
+
+struct StageTransforms {
+  glm::mat4 backRockMat = glm::mat4(1.0);
+  glm::mat4 stageMat = glm::mat4(1.0);
+  glm::mat4 frogMat = glm::mat4(1.0);
+  glm::mat4 rockMat1 = glm::mat4(1.0);
+  glm::mat4 rockMat2 = glm::mat4(1.0);
+  glm::mat4 rockMat3 = glm::mat4(1.0);
+};
+
+StageTransforms stageTransforms();
+
+// height and strength of the shadow catching ground plane
+const float STAGE_GROUND_Y = -1.925f;
+const float STAGE_SHADOW_STRENGTH = 0.6f;
+
+// what buildStageRTScene() created
+struct StageRTIds {
+  int matFrog = -1;
+  int matGround = -1;
+  int frogMesh = -1;
+  int rockInst1 = -1, rockInst2 = -1, frogInst = -1;
+};
+
+// Loads the textures and fills rt with the stage: back wall and stage baked
+// in world space, the rock mesh instanced twice and the frog instanced once.
+// The geometry goes through an RTSceneBuilder on pool.
+StageRTIds buildStageRTScene(RTScene& rt, const Mesh& backRock, const Mesh& stage, const Mesh& rock, const Mesh& frog, const StageTransforms& xf,
+                             ThreadPool* pool = nullptr);
+
+// places scene.meshes[meshId] (see RTSceneBuilder::addMesh())
+int addRTInstance(RTScene& rt, int meshId, const glm::mat4& modelMat);
+
+// point light placed relative to the camera
+RTLight stageRTLight(const RTCamera& cam);
@@ -0,0 +1,126 @@
+#include "ThreadPool.h"
+
+#include <algorithm>
+
+ThreadPool::ThreadPool(int threadCount) : _pending(0) {
+  if(threadCount <= 0) threadCount = (int)std::thread::hardware_concurrency();
+  threadCount = std::max(1, threadCount);
+
+  for(int i = 0; i < threadCount; ++i)
+    _queues.push_back(std::unique_ptr<WorkQueue>(new WorkQueue()));
+
+  for(int i = 1; i < threadCount; ++i)
+    _threads.push_back(std::thread(&ThreadPool::workerLoop, this, i));
+}
+
+ThreadPool::~ThreadPool() {
+  {
+    std::lock_guard<std::mutex> lk(_m);
+    _stop = true;
+  }
+  _wake.notify_all();
+  for(auto& t : _threads) t.join();
+}
+
+void ThreadPool::parallelFor(int taskCount, const std::function<void(int)>& task) {
+  if(taskCount <= 0) return;
+
+  std::lock_guard<std::mutex> call(_callMutex);
+
+  const int n = size();
+  if(n == 1 || taskCount == 1) {
+    for(int i = 0; i < taskCount; ++i) task(i);
+    return;
+  }
+
+  _pending = taskCount;
+
+  // contiguous runs per worker: neighbouring tasks stay on the same core
+  for(int w = 0; w < n; ++w) {
+    int begin = (int)((long long)taskCount * w / n);
+    int end   = (int)((long long)taskCount * (w + 1) / n);
+
+    std::lock_guard<std::mutex> lk(_queues[w]->m);
+    for(int i = begin; i < end; ++i) {
+      Task t;
+      t.fn = &task;
+      t.index = i;
+      _queues[w]->tasks.push_back(t);
+    }
+  }
+
+  {
+    std::lock_guard<std::mutex> lk(_m);
+    ++_generation;
+  }
+  _wake.notify_all();
+
+  while(runOne(0)) {}
+
+  std::unique_lock<std::mutex> lk(_m);
+  _done.wait(lk, [&]{ return _pending.load() == 0; });
+}
+
+void ThreadPool::workerLoop(int worker) {
+  unsigned seen = 0;
+  for(;;) {
+    {
+      std::unique_lock<std::mutex> lk(_m);
+      _wake.wait(lk, [&]{ return _stop || _generation != seen; });
+      if(_stop) return;
+      seen = _generation;
+    }
+    while(runOne(worker)) {}
+  }
+}
+
+bool ThreadPool::popLocal(int worker, Task& out) {
+  WorkQueue& q = *_queues[worker];
+  std::lock_guard<std::mutex> lk(q.m);
+  if(q.tasks.empty()) return false;
+  out = q.tasks.front();
+  q.tasks.pop_front();
+  return true;
+}
+
+bool ThreadPool::steal(int worker, Task& out) {
+  const int n = size();
+  for(int k = 1; k < n; ++k) {
+    WorkQueue& q = *_queues[(worker + k) % n];
+    std::lock_guard<std::mutex> lk(q.m);
+    if(q.tasks.empty()) continue;
+    out = q.tasks.back();
+    q.tasks.pop_back();
+    return true;
+  }
+  return false;
+}
+
+bool ThreadPool::runOne(int worker) {
+  Task t;
+  if(!popLocal(worker, t) && !steal(worker, t)) return false;
+
+  (*t.fn)(t.index);
+
+  if(_pending.fetch_sub(1) == 1) {
+    std::lock_guard<std::mutex> lk(_m);
+    _done.notify_all();
+  }
+  return true;
+}
+
+void parallelChunks(ThreadPool* pool, int n, int grain, const std::function<void(int, int)>& fn) {
+  int chunks = pool ? std::min(pool->size() * 4, (n + grain - 1) / grain) : 1;
+  if(chunks <= 1) {
+    fn(0, n);
+    return;
+  }
+  pool->parallelFor(chunks, [&](int c) {
+    fn((int)((long long)n * c / chunks), (int)((long long)n * (c + 1) / chunks));
+  });
+}
+
+void forChunks(ThreadPool* pool, int chunks, const std::function<void(int)>& fn) {
+  if(pool && chunks > 1) pool->parallelFor(chunks, fn);
+  else for(int c = 0; c < chunks; ++c) fn(c);
+}
@@ -0,0 +1,67 @@
+#pragma once
+#include <atomic>
+#include <condition_variable>
+#include <deque>
+#include <functional>
+#include <memory>
+#include <mutex>
+#include <thread>
+#include <vector>
+
+// Small work-stealing pool used to spread ray tracing work over the cores.
+//
+// Every worker owns a deque of task indices. A parallelFor() hands each
+// worker a contiguous run of indices (so a worker walks neighbouring tiles),
+// workers pop from the front of their own deque and, once it is empty, steal
+// from the back of another worker's deque. The calling thread acts as
+// worker 0, so a pool of N threads only spawns N-1 extra threads.
+class ThreadPool {
+public:
+  // threadCount <= 0 picks std::thread::hardware_concurrency()
+  explicit ThreadPool(int threadCount = 0);
+  ~ThreadPool();
+
+  ThreadPool(const ThreadPool&) = delete;
+  ThreadPool& operator=(const ThreadPool&) = delete;
+
+  int size() const { return (int)_queues.size(); }
+
+  // Runs task(i) for every i in [0, taskCount) and blocks until all are done.
+  // Calls from several threads run one after the other; a task must not call
+  // parallelFor() on its own pool, that call would wait forever on the first.
+  void parallelFor(int taskCount, const std::function<void(int)>& task);
+
+private:
+  struct Task {
+    const std::function<void(int)>* fn = nullptr;
+    int index = 0;
+  };
+
+  struct WorkQueue {
+    std::mutex m;
+    std::deque<Task> tasks;
+  };
+
+  void workerLoop(int worker);
+  bool popLocal(int worker, Task& out);
+  bool steal(int worker, Task& out);
+  bool runOne(int worker);
+
+  std::vector<std::thread> _threads;
+  std::vector<std::unique_ptr<WorkQueue>> _queues;
+
+  std::mutex _callMutex;
+  std::mutex _m;
+  std::condition_variable _wake;
+  std::condition_variable _done;
+  std::atomic<int> _pending;
+  unsigned _generation = 0;
+  bool _stop = false;
+};
+
+// Runs fn(begin, end) over [0, n) in chunks of at least grain items spread
+// over the pool, or in a single call when pool is null
+void parallelChunks(ThreadPool* pool, int n, int grain, const std::function<void(int, int)>& fn);
+
+// Runs fn(chunk) for every chunk in [0, chunks), on the pool when there is one
+void forChunks(ThreadPool* pool, int chunks, const std::function<void(int)>& fn);
@@ -0,0 +1,68 @@
+#pragma once
+#include <glm/glm.hpp>
+#include <atomic>
+#include <vector>
+
+// A finished block of the ray traced image
+struct RTTile {
+  int x0 = 0, y0 = 0;
+  int w = 0, h = 0;
+  std::vector<glm::vec3> pixels; // w*h, row by row
+};
+
+// Multi-producer / single-consumer queue of finished tiles. Producers link
+// their node in front of the list with a CAS, the consumer takes the whole
+// list with one exchange, so neither side ever waits on a lock.
+class TileQueue {
+public:
+  TileQueue() : _head(nullptr) {}
+  ~TileQueue() { clear(); }
+
+  TileQueue(const TileQueue&) = delete;
+  TileQueue& operator=(const TileQueue&) = delete;
+
+  void push(RTTile&& tile) {
+    Node* n = new Node;
+    n->tile = std::move(tile);
+    n->next = _head.load(std::memory_order_relaxed);
+    while(!_head.compare_exchange_weak(n->next, n, std::memory_order_release, std::memory_order_relaxed)) {}
+  }
+
+  // Appends every queued tile to out, oldest first
+  void popAll(std::vector<RTTile>& out) {
+    Node* n = _head.exchange(nullptr, std::memory_order_acquire);
+
+    // the list is newest first
+    Node* prev = nullptr;
+    while(n) {
+      Node* next = n->next;
+      n->next = prev;
+      prev = n;
+      n = next;
+    }
+
+    while(prev) {
+      Node* next = prev->next;
+      out.push_back(std::move(prev->tile));
+      delete prev;
+      prev = next;
+    }
+  }
+
+  void clear() {
+    Node* n = _head.exchange(nullptr, std::memory_order_acquire);
+    while(n) {
+      Node* next = n->next;
+      delete n;
+      n = next;
+    }
+  }
+
+private:
+  struct Node {
+    RTTile tile;
+    Node* next = nullptr;
+  };
+
+  std::atomic<Node*> _head;
+};
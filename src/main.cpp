@@ -45,6 +45,9 @@
 #include "Mesh.h"
 
 #include "RayTracer.h"
+#include "RayTraceJob.h"
+#include "RTSceneBuilder.h"
+#include "StageScene.h"
 #include "EnvMap.h"
 #include "Texture2D.h"
 #include "FrogSelectAnim.h"
@@ -88,6 +91,9 @@ std::shared_ptr<ShaderProgram> g_skyShader = nullptr;
 bool g_doRayTrace = false;
 
 static bool g_showRayTrace = false;
+static bool g_rtFrogEdited = false; // frog vertices changed since the last ray trace
+static RayTraceJob g_rtJob;
+static int g_rtMaxSamples = 16; // jittered passes per trace, converged tiles stop earlier
 static GLuint g_rtTex = 0;
 static int g_rtW = 800, g_rtH = 600;
 
@@ -477,6 +483,7 @@ void keyCallback(GLFWwindow *window, int key, int scancode, int action, int mods
   } else if(action == GLFW_PRESS && key == GLFW_KEY_R) {
     g_doRayTrace = true;
   } else if (action == GLFW_PRESS && key == GLFW_KEY_K) {
+    g_rtJob.cancel();
     g_showRayTrace = false;
   } else if(action == GLFW_PRESS && key == GLFW_KEY_P) {
       glm::mat4 invV = glm::inverse(g_cam->computeViewMatrix());
@@ -489,11 +496,13 @@ void keyCallback(GLFWwindow *window, int key, int scancode, int action, int mods
       if(g_scene.frog) {
         g_scene.frog->bilateralFilterWelded(2, 2.0f, 0.6f, 1e-6f);
         g_scene.frog->updatePositionsAndNormalsOnGPU();
+        g_rtFrogEdited = true;
       }
   } else if (action == GLFW_PRESS && key == GLFW_KEY_U) {
       if (g_scene.frog) {
         g_scene.frog->restoreState();
         g_scene.frog->updatePositionsAndNormalsOnGPU();
+        g_rtFrogEdited = true;
       }
 }
 
@@ -677,34 +686,13 @@ void initScene(const std::string &meshFilename)
     g_scene.frog->init();
 
     
-    glm::vec3 Stage_Position(-0.05f, -0.55f, -5.5f);
-    glm::vec3 Full_Object_Scale(0.129f);
-
-    glm::mat4 stageTranslate = glm::translate(glm::mat4(1.0f), Stage_Position);
-    glm::mat4 stageRotate = glm::rotate(glm::mat4(1.0f), glm::radians(-35.0f), glm::vec3(0,1,0));
-    glm::mat4 stageScale = glm::scale(glm::mat4(1.0f), Full_Object_Scale);
-
-    g_scene.stageMat = 
-        stageTranslate *
-        stageRotate *
-        stageScale;
-
-    glm::vec3 Wall_Position = Stage_Position + glm::vec3(0.0f, 0.05f, 0.0f);
-    glm::mat4 wallTranslate = glm::translate(glm::mat4(1.0f), Wall_Position);
-
-    g_scene.backRockMat =
-        wallTranslate *
-        stageRotate *
-        stageScale;
-
-    glm::mat4 rockScale = glm::scale(glm::mat4(1.0f), glm::vec3(0.2f));
-    g_scene.rockMat1 = stageTranslate * glm::translate(glm::mat4(1.0f), glm::vec3(-0.2f, -0.7f, 1.8f)) * rockScale;
-    g_scene.rockMat2 = stageTranslate * glm::translate(glm::mat4(1.0f), glm::vec3(-1.2f, -0.7f, 2.0f)) * rockScale;
-    g_scene.rockMat3 = stageTranslate * glm::translate(glm::mat4(1.0f), glm::vec3(-0.2f, -10.7f, 1.5f)) * rockScale;
-
-    glm::mat4 frogRotate = glm::rotate(glm::mat4(1.0f), glm::radians(-125.0f), glm::vec3(0,1,0));
-
-    g_scene.frogMat = stageTranslate * glm::translate(glm::mat4(1.0f), glm::vec3(-1.2f, -0.46f, 1.95f)) * frogRotate * glm::scale(glm::mat4(1.0f), glm::vec3(0.015f));
+    StageTransforms xf = stageTransforms();
+    g_scene.stageMat = xf.stageMat;
+    g_scene.backRockMat = xf.backRockMat;
+    g_scene.rockMat1 = xf.rockMat1;
+    g_scene.rockMat2 = xf.rockMat2;
+    g_scene.rockMat3 = xf.rockMat3;
+    g_scene.frogMat = xf.frogMat;
     g_frogSelect.initFromFrogMat(g_scene.frogMat);
 
   }
@@ -758,46 +746,140 @@ static void initRaytraceDisplay(){
 
 
 
-static void appendMeshToRTScene(RTScene& rt, const Mesh& mesh, const glm::mat4& modelMat, int matId){
-  glm::mat3 normalMat = glm::transpose(glm::inverse(glm::mat3(modelMat)));
+// Ray tracing data kept between R presses: textures, env map and BVHs are
+// loaded and built on the first press, later presses only update the
+// instance transforms and the frog geometry when they changed.
+struct RTState {
+  bool ready = false;
+  RTScene scene;
+  EnvMap env;
+  std::unique_ptr<RayTracer> tracer;
 
-  const auto& P = mesh.vertexPositions();
-  const auto& N = mesh.vertexNormals();
-  const auto& T = mesh.triangleIndices();
-  const auto& UV = mesh.vertexTexCoords();
+  int matFrog = -1;
+  int frogMesh = -1;
+  int rockInst1 = -1, rockInst2 = -1, frogInst = -1;
+};
 
+static RTState g_rtState;
 
-  for (size_t i = 0; i < T.size(); ++i) {
-    glm::uvec3 triIdx = T[i];
+static void initRTState(int W, int H){
+  RTState& rt = g_rtState;
 
-    auto xformP = [&](uint32_t idx){
-      return glm::vec3(modelMat * glm::vec4(P[idx], 1.f));
-    };
-    auto xformN = [&](uint32_t idx){
-      return glm::normalize(normalMat * N[idx]);
-    };
+  StageTransforms xf;
+  xf.backRockMat = g_scene.backRockMat;
+  xf.stageMat = g_scene.stageMat;
+  xf.rockMat1 = g_scene.rockMat1;
+  xf.rockMat2 = g_scene.rockMat2;
+  xf.frogMat = g_scene.frogMat;
 
-    RTTriangle tri;
+  rt.tracer.reset(new RayTracer(W, H));
 
-    if(!UV.empty()) {
-      tri.uv0 = UV[triIdx[0]];
-      tri.uv1 = UV[triIdx[1]];
-      tri.uv2 = UV[triIdx[2]];
-    } else {
-      tri.uv0 = tri.uv1 = tri.uv2 = glm::vec2(0.0f);
-    }
+  StageRTIds ids = buildStageRTScene(rt.scene, *g_scene.back_rock, *g_scene.stage, *g_scene.rock, *g_scene.frog, xf,
+                                     &rt.tracer->threadPool());
+  rt.matFrog = ids.matFrog;
+  rt.frogMesh = ids.frogMesh;
+  rt.rockInst1 = ids.rockInst1;
+  rt.rockInst2 = ids.rockInst2;
+  rt.frogInst = ids.frogInst;
+
+  rt.env.loadHDR("data/farmland_overcast_4k.hdr");
+
+  rt.tracer->setBVHBuildMode(BVHBuildMode::LBVH); // interactive: quick (re)builds
+  rt.tracer->setEnvMap(&rt.env);
+  rt.tracer->buildBVH(rt.scene);
+  rt.tracer->setGround(STAGE_GROUND_Y, ids.matGround, STAGE_SHADOW_STRENGTH);
+
+  rt.ready = true;
+  g_rtFrogEdited = false;
+}
+
+static bool setRTInstanceTransform(int inst, const glm::mat4& modelMat){
+  glm::mat4& cur = g_rtState.scene.instances[inst].transform;
+  if(cur == modelMat) return false;
+  cur = modelMat;
+  return true;
+}
+
+static void updateRTState(){
+  RTState& rt = g_rtState;
+
+  bool moved = false;
+  moved |= setRTInstanceTransform(rt.rockInst1, g_scene.rockMat1);
+  moved |= setRTInstanceTransform(rt.rockInst2, g_scene.rockMat2);
+  moved |= setRTInstanceTransform(rt.frogInst, g_scene.frogMat);
+
+  if(g_rtFrogEdited) {
+    // same triangles, moved vertices: refit instead of rebuilding; the
+    // refit also takes the instance transforms set above
+    RTSceneBuilder builder(rt.scene);
+    builder.replaceMesh(rt.frogMesh, *g_scene.frog, rt.matFrog);
+    builder.build(&rt.tracer->threadPool());
+    g_rtFrogEdited = false;
+    rt.tracer->refitMesh(rt.scene, rt.frogMesh);
+  } else if(moved) {
+    rt.tracer->updateInstances(rt.scene);
+  }
+}
+
+
+
+static RTCamera currentRTCamera(){
+  RTCamera cam;
+  cam.pos = g_cam->getPosition();
+  cam.invView = glm::inverse(g_cam->computeViewMatrix());
+  cam.fovYDegrees = g_cam->getFov();
+  cam.aspect = g_cam->getAspectRatio();
+  return cam;
+}
+
+// (Re)starts the background trace from the current camera
+static void startRayTrace(){
+  // the job reads the resident scene, so it has to stop before any update
+  g_rtJob.cancel();
+
+  if(!g_rtState.ready) initRTState(g_rtW, g_rtH);
+  else updateRTState();
+
+  RTCamera cam = currentRTCamera();
+  RTLight L = stageRTLight(cam);
+
+  g_rtJob.start(*g_rtState.tracer, g_rtState.scene, cam, L, g_rtMaxSamples);
+  g_showRayTrace = true;
+}
 
-    tri.p0 = xformP(triIdx[0]);
-    tri.p1 = xformP(triIdx[1]);
-    tri.p2 = xformP(triIdx[2]);
-    tri.n0 = xformN(triIdx[0]);
-    tri.n1 = xformN(triIdx[1]);
-    tri.n2 = xformN(triIdx[2]);
-    tri.matId = matId;
+// Called every frame: uploads the tiles finished so far, restarts the trace
+// when the camera moved while it was running
+static void pollRayTrace(){
+  if(!g_rtJob.running()) return;
 
-    rt.tris.push_back(tri);
+  if(!g_rtJob.done() && currentRTCamera().invView != g_rtJob.camera().invView) {
+    startRayTrace();
+    return;
   }
 
+  bool done = g_rtJob.done();
+
+  std::vector<RTTile> tiles;
+  g_rtJob.popTiles(tiles);
+
+  if(!tiles.empty()) {
+    glBindTexture(GL_TEXTURE_2D, g_rtTex);
+    for(const RTTile& t : tiles)
+      glTexSubImage2D(GL_TEXTURE_2D, 0, t.x0, t.y0, t.w, t.h, GL_RGB, GL_FLOAT, t.pixels.data());
+    glBindTexture(GL_TEXTURE_2D, 0);
+  }
+
+  if(done) {
+    // every tile was queued before done() turned true, so none is left
+    g_rtJob.finish();
+
+    const RTStats& st = g_rtState.tracer->stats();
+    std::cout << " > Ray trace: " << g_rtJob.passes() << " passes, last pass "
+              << st.rays << " rays, "
+              << st.nodesPerRay() << " nodes/ray, "
+              << st.boxTestsPerRay() << " box tests/ray, "
+              << st.triTestsPerRay() << " triangle tests/ray" << std::endl;
+  }
 }
 
 
@@ -810,6 +892,8 @@ void init(const std::string &meshFilename)
 
 void clear()
 {
+  g_rtJob.cancel();
+  g_rtState.tracer.reset();
   g_cam.reset();
   g_scene.mainShader.reset();
   g_scene.shadomMapShader.reset();
@@ -853,102 +937,9 @@ int main(int argc, char **argv)
 
     if (g_doRayTrace) {
       g_doRayTrace = false;
-      int W = g_rtW, H = g_rtH;
-
-      RTScene rt;
-
-      rt.mats.clear();
-      rt.textures.clear();
-
-      int texWall = (int)rt.textures.size();
-      rt.textures.push_back(Texture2D());
-      rt.textures.back().load("data/rock_back_texture.png", true);
-
-      int texStage = (int)rt.textures.size();
-      rt.textures.push_back(Texture2D());
-      rt.textures.back().load("data/wood_table_diff_2k.jpg", true);
-
-      // Rock
-      int matRock = (int)rt.mats.size();
-      rt.mats.push_back(RTMaterial());
-      rt.mats.back().albedo = glm::vec3(0.65f);
-      rt.mats.back().shadowCatcher = false;
-      rt.mats.back().useTexture = false;
-      rt.mats.back().texId = -1;
-
-      // Backwall
-      int matWall = (int)rt.mats.size();
-      rt.mats.push_back(RTMaterial());
-      rt.mats.back().albedo = glm::vec3(1.0f);
-      rt.mats.back().shadowCatcher = false;
-      rt.mats.back().useTexture = true;
-      rt.mats.back().texId = texWall;
-
-      // Stage
-      int matStage = (int)rt.mats.size();
-      rt.mats.push_back(RTMaterial());
-      rt.mats.back().albedo = glm::vec3(1.0f);
-      rt.mats.back().shadowCatcher = false;
-      rt.mats.back().useTexture = true;
-      rt.mats.back().texId = texStage;
-
-      // Frog
-      int matFrog = (int)rt.mats.size();
-      rt.mats.push_back(RTMaterial());
-      rt.mats.back().albedo = glm::vec3(0.35f, 0.95f, 0.35f);
-      // rt.mats.back().albedo = glm::vec3(0.0f, 0.86f, 0.61f);
-      rt.mats.back().shadowCatcher = false;
-      rt.mats.back().useTexture = false;
-      rt.mats.back().texId = -1;
-
-      // ground
-      int matGround = (int)rt.mats.size();
-      rt.mats.push_back(RTMaterial());
-      rt.mats.back().albedo = glm::vec3(1.0f);
-      rt.mats.back().shadowCatcher = true;
-      rt.mats.back().useTexture = false;
-      rt.mats.back().texId = -1;
-
-      appendMeshToRTScene(rt, *g_scene.back_rock, g_scene.backRockMat, matWall);
-      appendMeshToRTScene(rt, *g_scene.stage, g_scene.stageMat, matStage);
-      appendMeshToRTScene(rt, *g_scene.rock, g_scene.rockMat1, matRock);
-      appendMeshToRTScene(rt, *g_scene.rock, g_scene.rockMat2, matRock);
-      appendMeshToRTScene(rt, *g_scene.frog, g_scene.frogMat, matFrog);
-
-      RTCamera cam;
-      cam.pos = g_cam->getPosition();
-      cam.invView = glm::inverse(g_cam->computeViewMatrix());
-      cam.fovYDegrees = g_cam->getFov();
-      cam.aspect = g_cam->getAspectRatio();
-
-      glm::mat4 invV = cam.invView;
-      glm::vec3 right = glm::vec3(invV[0]);
-      glm::vec3 up = glm::vec3(invV[1]);
-      glm::vec3 forward = -glm::vec3(invV[2]);
-
-      RTLight L;
-      L.position  = cam.pos + (-1.5f)*right + (3.0f)*up + (3.0f)*forward;
-      L.color     = glm::vec3(1.f);
-      L.intensity = 15.0f;
-      
-      
-      EnvMap env;
-      env.loadHDR("data/farmland_overcast_4k.hdr");
-
-
-      RayTracer tracer(W, H);
-      tracer.setEnvMap(&env);
-      tracer.buildBVH(rt);
-      tracer.setGround(-1.925f, matGround, 0.6f);
-
-      auto pixels = tracer.render(rt, cam, L);
-      
-      glBindTexture(GL_TEXTURE_2D, g_rtTex);
-      glTexSubImage2D(GL_TEXTURE_2D, 0, 0, 0, W, H, GL_RGB, GL_FLOAT, pixels.data());
-      glBindTexture(GL_TEXTURE_2D, 0);
-
-      g_showRayTrace = true;
+      startRayTrace();
     }
+    pollRayTrace();
 
 
     glfwSwapBuffers(g_window);
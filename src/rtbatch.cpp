@@ -0,0 +1,240 @@
+// ----------------------------------------------------------------------------
+// rtbatch.cpp
+//
+// Description: renders the frog stage with the CPU ray tracer and writes a
+// PPM file, without opening a window or creating a GL context.
+// ----------------------------------------------------------------------------
+
+#include <glm/glm.hpp>
+#include <glm/ext.hpp>
+
+#include <chrono>
+#include <cstdlib>
+#include <cstring>
+#include <exception>
+#include <iostream>
+#include <memory>
+#include <string>
+
+#include "Camera.h"
+#include "Mesh.h"
+#include "PPMWriter.h"
+#include "RayTracer.h"
+#include "StageScene.h"
+
+struct BatchOptions {
+  int width = 800;
+  int height = 600;
+  int samples = 1;
+  int threads = 0;
+  BVHBuildMode bvh = BVHBuildMode::SAH;
+  BVHLayout layout = BVHLayout::Wide4;
+  RTVertexFormat vertices = RTVertexFormat::Full;
+  glm::vec3 camPos = glm::vec3(0.f, 0.f, 3.f);
+  glm::vec3 camRot = glm::vec3(0.f); // radians, as Camera::setRotation
+  float fov = 45.f;
+  std::string frog = "data/frog_decimated.obj";
+  std::string env = "data/farmland_overcast_4k.hdr";
+  std::string out = "render.ppm";
+  std::string bvhCache;
+  bool wavefront = false;
+  bool packets = true;
+};
+
+static void usage(const char *command)
+{
+  std::cerr << "Usage : " << command << " [options]" << std::endl <<
+    "    -o <file.ppm>       output image (render.ppm)" << std::endl <<
+    "    -w <width>          image width (800)" << std::endl <<
+    "    -h <height>         image height (600)" << std::endl <<
+    "    -s <samples>        samples per pixel, > 1 for progressive jittered passes (1)" << std::endl <<
+    "    -t <threads>        render threads, 0 for all cores (0)" << std::endl <<
+    "    --bvh <builder>     sah, median, lbvh or lbvh-treelet (sah)" << std::endl <<
+    "    --bvh-layout <l>    binary, wide4 or wide4q (quantized wide4 nodes) (wide4)" << std::endl <<
+    "    --bvh-cache <dir>   reuse the BVHs saved in this existing directory" << std::endl <<
+    "    --compact-vertices  octahedral normals and half precision uvs in the scene" << std::endl <<
+    "    --wavefront         trace tiles through the wavefront pipeline" << std::endl <<
+    "    --no-packets        trace camera rays one by one instead of in 4x4 packets" << std::endl <<
+    "    --pos <x> <y> <z>   camera position (0 0 3)" << std::endl <<
+    "    --rot <x> <y> <z>   camera rotation in radians (0 0 0)" << std::endl <<
+    "    --fov <degrees>     vertical field of view (45)" << std::endl <<
+    "    --frog <mesh>       frog mesh, .obj or .off (data/frog_decimated.obj)" << std::endl <<
+    "    --env <file.hdr>    environment map, empty for the gradient sky" << std::endl;
+  std::exit(EXIT_FAILURE);
+}
+
+static BatchOptions parseArgs(int argc, char **argv)
+{
+  BatchOptions o;
+  for(int i = 1; i < argc; ++i) {
+    std::string a = argv[i];
+    auto need = [&](int n) { if(i + n >= argc) usage(argv[0]); };
+
+    if(a == "-o") { need(1); o.out = argv[++i]; }
+    else if(a == "-w") { need(1); o.width = std::atoi(argv[++i]); }
+    else if(a == "-h") { need(1); o.height = std::atoi(argv[++i]); }
+    else if(a == "-s") { need(1); o.samples = std::atoi(argv[++i]); }
+    else if(a == "-t") { need(1); o.threads = std::atoi(argv[++i]); }
+    else if(a == "--fov") { need(1); o.fov = (float)std::atof(argv[++i]); }
+    else if(a == "--frog") { need(1); o.frog = argv[++i]; }
+    else if(a == "--env") { need(1); o.env = argv[++i]; }
+    else if(a == "--bvh-cache") { need(1); o.bvhCache = argv[++i]; }
+    else if(a == "--compact-vertices") o.vertices = RTVertexFormat::Compact;
+    else if(a == "--wavefront") o.wavefront = true;
+    else if(a == "--no-packets") o.packets = false;
+    else if(a == "--bvh") {
+      need(1);
+      std::string b = argv[++i];
+      if(b == "sah") o.bvh = BVHBuildMode::SAH;
+      else if(b == "median") o.bvh = BVHBuildMode::Median;
+      else if(b == "lbvh") o.bvh = BVHBuildMode::LBVH;
+      else if(b == "lbvh-treelet") o.bvh = BVHBuildMode::LBVHTreelet;
+      else usage(argv[0]);
+    }
+    else if(a == "--bvh-layout") {
+      need(1);
+      std::string l = argv[++i];
+      if(l == "binary") o.layout = BVHLayout::Binary;
+      else if(l == "wide4") o.layout = BVHLayout::Wide4;
+      else if(l == "wide4q") o.layout = BVHLayout::Wide4Quantized;
+      else usage(argv[0]);
+    }
+    else if(a == "--pos" || a == "--rot") {
+      need(3);
+      glm::vec3 v((float)std::atof(argv[i+1]), (float)std::atof(argv[i+2]), (float)std::atof(argv[i+3]));
+      i += 3;
+      if(a == "--pos") o.camPos = v; else o.camRot = v;
+    }
+    else usage(argv[0]);
+  }
+  if(o.width <= 0 || o.height <= 0) usage(argv[0]);
+  return o;
+}
+
+static std::shared_ptr<Mesh> loadMesh(const std::string &filename)
+{
+  std::shared_ptr<Mesh> mesh = std::make_shared<Mesh>();
+  size_t dot = filename.rfind('.');
+  std::string ext = dot == std::string::npos ? "" : filename.substr(dot);
+  if(ext == ".off") loadOFF(filename, mesh);
+  else loadOBJ(filename, mesh);
+  return mesh;
+}
+
+static double msSince(std::chrono::steady_clock::time_point t0)
+{
+  return std::chrono::duration<double, std::milli>(std::chrono::steady_clock::now() - t0).count();
+}
+
+int main(int argc, char **argv)
+{
+  BatchOptions opt = parseArgs(argc, argv);
+
+  auto t0 = std::chrono::steady_clock::now();
+
+  std::shared_ptr<Mesh> backRock, stage, rock, frog;
+  try {
+    backRock = loadMesh("data/rock_back.obj");
+    stage = loadMesh("data/stage.obj");
+    rock = loadMesh("data/rock.obj");
+    frog = loadMesh(opt.frog);
+  } catch(std::exception &e) {
+    std::cerr << "[Error loading meshes] " << e.what() << std::endl;
+    return EXIT_FAILURE;
+  }
+
+  RayTracer tracer(opt.width, opt.height);
+  tracer.setThreadCount(opt.threads);
+
+  RTScene scene;
+  scene.tris.format = opt.vertices;
+  StageRTIds ids = buildStageRTScene(scene, *backRock, *stage, *rock, *frog, stageTransforms(), &tracer.threadPool());
+
+  EnvMap env;
+  bool hasEnv = !opt.env.empty() && env.loadHDR(opt.env);
+
+  double loadMs = msSince(t0);
+
+  tracer.setBVHBuildMode(opt.bvh);
+  tracer.setBVHLayout(opt.layout);
+  tracer.setBVHCacheDir(opt.bvhCache);
+  if(opt.wavefront) tracer.setPipeline(RTPipeline::Wavefront);
+  tracer.setPrimaryPackets(opt.packets);
+  if(hasEnv) tracer.setEnvMap(&env);
+  tracer.setGround(STAGE_GROUND_Y, ids.matGround, STAGE_SHADOW_STRENGTH);
+
+  t0 = std::chrono::steady_clock::now();
+  tracer.buildBVH(scene);
+  double buildMs = msSince(t0);
+
+  size_t triCount = scene.tris.size();
+  size_t geometryBytes = scene.tris.memoryBytes();
+  for(const RTMesh& m : scene.meshes) {
+    triCount += m.tris.size();
+    geometryBytes += m.tris.memoryBytes();
+  }
+  double bvhBytesPerTri = triCount ? double(tracer.bvhMemoryBytes(true)) / triCount : 0.0;
+
+  Camera c;
+  c.setPosition(opt.camPos);
+  c.setRotation(opt.camRot);
+  c.setFoV(opt.fov);
+  c.setAspectRatio(float(opt.width) / float(opt.height));
+
+  RTCamera cam;
+  cam.pos = c.getPosition();
+  cam.invView = glm::inverse(c.computeViewMatrix());
+  cam.fovYDegrees = c.getFov();
+  cam.aspect = c.getAspectRatio();
+
+  RTLight light = stageRTLight(cam);
+
+  t0 = std::chrono::steady_clock::now();
+  std::vector<glm::vec3> pixels;
+  int passes = 1;
+  unsigned long long rays = 0;
+  bool saved;
+
+  if(opt.samples <= 1) {
+    // tiles are tone mapped and written while the rest of the frame traces
+    PPMWriter out;
+    if(!out.open(opt.out, opt.width, opt.height, RayTracer::tileSize())) {
+      std::cerr << "[Error] cannot write " << opt.out << std::endl;
+      return EXIT_FAILURE;
+    }
+    tracer.render(scene, cam, light, pixels, [&](int x0, int y0, int x1, int y1) {
+      out.writeTile(x0, y0, x1, y1, pixels.data() + (size_t)y0 * opt.width + x0, opt.width);
+    }, nullptr);
+    rays = tracer.stats().rays;
+    saved = out.close();
+  } else {
+    RTAccumBuffer acc;
+    for(passes = 0; passes < opt.samples; ) {
+      int active = tracer.renderPass(scene, cam, light, acc, RayTracer::TileCallback(), nullptr);
+      ++passes;
+      rays += tracer.stats().rays;
+      if(active == 0) break;
+    }
+
+    pixels.resize(opt.width * opt.height);
+    for(int y = 0; y < opt.height; ++y)
+      for(int x = 0; x < opt.width; ++x)
+        pixels[y * opt.width + x] = acc.pixel(x, y);
+    saved = RayTracer::savePPM(opt.out, pixels, opt.width, opt.height);
+  }
+  double renderMs = msSince(t0);
+
+  if(!saved) {
+    std::cerr << "[Error] cannot write " << opt.out << std::endl;
+    return EXIT_FAILURE;
+  }
+
+  std::cout << " > " << opt.out << ": " << opt.width << "x" << opt.height
+            << ", " << passes << " passes, " << rays << " rays" << std::endl
+            << " > load " << loadMs << " ms, BVH " << buildMs << " ms, render " << renderMs << " ms" << std::endl
+            << " > BVH " << bvhBytesPerTri << " bytes per triangle traversed, "
+            << tracer.bvhMemoryBytes() / 1024 << " KiB resident" << std::endl
+            << " > geometry " << (triCount ? double(geometryBytes) / triCount : 0.0) << " bytes per triangle" << std::endl;
+
+  return EXIT_SUCCESS;
+}
@@ -0,0 +1,587 @@
+// ----------------------------------------------------------------------------
+// rtbench.cpp
+//
+// Description: ray tracer benchmarks on the shipped assets. For every scene
+// it measures the BVH builds, single-threaded primary ray throughput
+// (single rays and 4x4 packets), shadow ray throughput (in scanline order,
+// shuffled, and shuffled then binned) and a full multi-threaded frame,
+// then prints the results as JSON. Every timing is the best of the
+// repetitions.
+// ----------------------------------------------------------------------------
+
+#include <glm/glm.hpp>
+#include <glm/ext.hpp>
+
+#include <algorithm>
+#include <chrono>
+#include <cmath>
+#include <cstdio>
+#include <cstdlib>
+#include <cstring>
+#include <exception>
+#include <iostream>
+#include <memory>
+#include <random>
+#include <string>
+#include <thread>
+#include <vector>
+
+#include "Camera.h"
+#include "Mesh.h"
+#include "RTSceneBuilder.h"
+#include "RayTracer.h"
+#include "StageScene.h"
+
+#ifdef __linux__
+#include <linux/perf_event.h>
+#include <sys/syscall.h>
+#include <unistd.h>
+#endif
+
+struct BenchOptions {
+  int width = 800;
+  int height = 600;
+  int reps = 3;
+  int threads = 0;
+  std::string frog = "data/frog_decimated.obj";
+  std::string out; // stdout when empty
+};
+
+struct BenchScene {
+  std::string name;
+  std::string source;
+  RTScene scene;
+  RTCamera cam;
+  RTLight light;
+  int groundMat = -1; // the ground plane's material, -1 for none
+};
+
+struct BenchResult {
+  std::string name;
+  std::string source;
+  size_t triangles = 0;
+  bool ground = false;
+  double buildSahMs = 0.0;
+  double buildMedianMs = 0.0;
+  double buildLbvhMs = 0.0;
+  double buildLbvhTreeletMs = 0.0;
+  unsigned long long primaryRays = 0;
+  double primaryMs = 0.0;
+  double primaryHitRate = 0.0;
+  double primaryPacketMs = 0.0;
+  unsigned long long shadowRays = 0;
+  double shadowMs = 0.0;
+  double shadowNodesPerRay = 0.0;
+  double shadowMissesPerRay = -1.0; // -1 without a cache miss counter
+  double shadowShuffledMs = 0.0;
+  double shadowShuffledMissesPerRay = -1.0;
+  double shadowBinnedMs = 0.0;
+  double shadowBinnedMissesPerRay = -1.0;
+  unsigned long long frameRays = 0;
+  double frameMs = 0.0;
+  double frameWavefrontMs = 0.0;
+  double bvhBytesPerTri = 0.0;          // traversed BVH memory, Wide4 nodes
+  double bvhQuantizedBytesPerTri = 0.0; // the same with Wide4Quantized nodes
+  double primaryQuantizedMs = 0.0;
+  double frameQuantizedMs = 0.0;
+  double sceneBytesPerTri = 0.0;        // vertices and indices, Full format
+  double sceneCompactBytesPerTri = 0.0; // the same in the Compact format
+  double frameCompactMs = 0.0;
+};
+
+typedef std::chrono::steady_clock Clock;
+
+static double msSince(Clock::time_point t0)
+{
+  return std::chrono::duration<double, std::milli>(Clock::now() - t0).count();
+}
+
+static void usage(const char *command)
+{
+  std::cerr << "Usage : " << command << " [options]" << std::endl <<
+    "    -w <width>       image width (800)" << std::endl <<
+    "    -h <height>      image height (600)" << std::endl <<
+    "    -r <reps>        repetitions per measurement, the best is kept (3)" << std::endl <<
+    "    -t <threads>     threads of the BVH builds and the full frame, 0 for all cores (0)" << std::endl <<
+    "    -o <file.json>   write the results there instead of stdout" << std::endl <<
+    "    --frog <mesh>    frog mesh of the stage scene (data/frog_decimated.obj)" << std::endl;
+  std::exit(EXIT_FAILURE);
+}
+
+static BenchOptions parseArgs(int argc, char **argv)
+{
+  BenchOptions o;
+  for(int i = 1; i < argc; ++i) {
+    std::string a = argv[i];
+    if(i + 1 >= argc) usage(argv[0]);
+    if(a == "-w") o.width = std::atoi(argv[++i]);
+    else if(a == "-h") o.height = std::atoi(argv[++i]);
+    else if(a == "-r") o.reps = std::atoi(argv[++i]);
+    else if(a == "-t") o.threads = std::atoi(argv[++i]);
+    else if(a == "-o") o.out = argv[++i];
+    else if(a == "--frog") o.frog = argv[++i];
+    else usage(argv[0]);
+  }
+  if(o.width <= 0 || o.height <= 0 || o.reps <= 0) usage(argv[0]);
+  return o;
+}
+
+static std::shared_ptr<Mesh> loadMesh(const std::string &filename)
+{
+  std::shared_ptr<Mesh> mesh = std::make_shared<Mesh>();
+  size_t dot = filename.rfind('.');
+  std::string ext = dot == std::string::npos ? "" : filename.substr(dot);
+  if(ext == ".off") loadOFF(filename, mesh);
+  else loadOBJ(filename, mesh);
+  return mesh;
+}
+
+static RTCamera makeCamera(const glm::vec3 &pos, float aspect)
+{
+  Camera c;
+  c.setPosition(pos);
+  c.setAspectRatio(aspect);
+
+  RTCamera cam;
+  cam.pos = c.getPosition();
+  cam.invView = glm::inverse(c.computeViewMatrix());
+  cam.fovYDegrees = c.getFov();
+  cam.aspect = c.getAspectRatio();
+  return cam;
+}
+
+// One mesh, baked in place, seen from its bounding sphere along -z
+static BenchScene singleMeshScene(const std::string &name, const std::string &filename, float aspect)
+{
+  std::shared_ptr<Mesh> mesh = loadMesh(filename);
+
+  BenchScene b;
+  b.name = name;
+  b.source = filename;
+  b.scene.mats.push_back(RTMaterial());
+  RTSceneBuilder builder(b.scene);
+  builder.appendStatic(*mesh, glm::mat4(1.f), 0);
+  builder.build();
+
+  glm::vec3 center;
+  float radius;
+  mesh->computeBoundingSphere(center, radius);
+
+  b.cam = makeCamera(center + glm::vec3(0.f, 0.f, 2.5f * radius), aspect);
+  b.light.position = center + radius * glm::vec3(-1.f, 2.f, 1.f);
+  b.light.intensity = 15.f;
+  return b;
+}
+
+// The viewer's stage from its default camera
+static BenchScene stageScene(const std::string &frogFile, float aspect)
+{
+  BenchScene b;
+  b.name = "stage";
+  b.source = frogFile;
+
+  std::shared_ptr<Mesh> frog;
+  try {
+    frog = loadMesh(frogFile);
+  } catch(std::exception &e) {
+    // the decimated frog is not always shipped, fall back on the rhino
+    b.source = "data/rhino2.off";
+    frog = loadMesh(b.source);
+  }
+
+  std::shared_ptr<Mesh> backRock = loadMesh("data/rock_back.obj");
+  std::shared_ptr<Mesh> stage = loadMesh("data/stage.obj");
+  std::shared_ptr<Mesh> rock = loadMesh("data/rock.obj");
+
+  StageRTIds ids = buildStageRTScene(b.scene, *backRock, *stage, *rock, *frog, stageTransforms());
+  b.groundMat = ids.matGround;
+
+  b.cam = makeCamera(glm::vec3(0.f, 0.f, 3.f), aspect);
+  b.light = stageRTLight(b.cam);
+  return b;
+}
+
+static size_t triangleCount(const RTScene &scene)
+{
+  size_t n = scene.tris.size();
+  for(const RTInstance &inst : scene.instances)
+    n += scene.meshes[inst.meshId].tris.size();
+  return n;
+}
+
+// geometry bytes per stored triangle (an instanced mesh counts once)
+static double geometryBytesPerTri(const RTScene &scene)
+{
+  size_t bytes = scene.tris.memoryBytes(), tris = scene.tris.size();
+  for(const RTMesh &m : scene.meshes) {
+    bytes += m.tris.memoryBytes();
+    tris += m.tris.size();
+  }
+  return tris ? double(bytes) / tris : 0.0;
+}
+
+static void reencode(RTGeometry &g, RTVertexFormat format)
+{
+  RTGeometry out;
+  out.format = format;
+  out.reserve(g.vertexCount(), g.size());
+  for(uint32_t v = 0; v < g.vertexCount(); ++v) out.addVertex(g.positions[v], g.normal(v), g.uv(v));
+  out.indices = g.indices;
+  out.matIds = g.matIds;
+  g = out;
+}
+
+// Last-level cache misses of the calling thread, from the kernel's
+// hardware counters. count() is negative when the counter is not available
+// (other systems, virtual machines, perf_event_paranoid).
+class CacheMissCounter {
+public:
+  CacheMissCounter()
+  {
+#ifdef __linux__
+    perf_event_attr attr;
+    memset(&attr, 0, sizeof(attr));
+    attr.size = sizeof(attr);
+    attr.type = PERF_TYPE_HARDWARE;
+    attr.config = PERF_COUNT_HW_CACHE_MISSES;
+    attr.exclude_kernel = 1;
+    attr.exclude_hv = 1;
+    _fd = (int)syscall(SYS_perf_event_open, &attr, 0, -1, -1, 0);
+#endif
+  }
+  ~CacheMissCounter()
+  {
+#ifdef __linux__
+    if(_fd >= 0) close(_fd);
+#endif
+  }
+
+  long long count() const
+  {
+#ifdef __linux__
+    long long v;
+    if(_fd >= 0 && read(_fd, &v, sizeof(v)) == sizeof(v)) return v;
+#endif
+    return -1;
+  }
+
+private:
+  int _fd = -1;
+};
+
+struct ShadowTiming {
+  double ms = 1e30;
+  double nodesPerRay = 0.0;
+  double missesPerRay = -1.0;
+};
+
+// Any-hit queries of a batch of rays on the calling thread, as they are
+// or binned by RayTracer::occludedBatch(); best of reps
+static ShadowTiming timeShadowRays(const RayTracer &tracer, const std::vector<RTRay> &rays,
+                                   const std::vector<float> &tMax, bool binned, int reps)
+{
+  ShadowTiming t;
+  CacheMissCounter misses;
+  std::vector<char> occluded;
+  for(int rep = 0; rep < reps; ++rep) {
+    RTStats before = rtThreadStats();
+    long long missesBefore = misses.count();
+    Clock::time_point t0 = Clock::now();
+    tracer.occludedBatch(rays, tMax, occluded, binned);
+    double ms = msSince(t0);
+    long long missesAfter = misses.count();
+
+    if(ms < t.ms) {
+      t.ms = ms;
+      const RTStats &now = rtThreadStats();
+      unsigned long long n = now.rays - before.rays;
+      t.nodesPerRay = n ? double(now.nodesVisited - before.nodesVisited) / double(n) : 0.0;
+      if(missesBefore >= 0 && missesAfter >= 0 && !rays.empty())
+        t.missesPerRay = double(missesAfter - missesBefore) / double(rays.size());
+    }
+  }
+  return t;
+}
+
+// same ray setup as RayTracer::tracePixel()
+static std::vector<RTRay> primaryRays(const RTCamera &cam, int w, int h)
+{
+  std::vector<RTRay> rays;
+  rays.reserve(w * h);
+  float tanHalf = std::tan(glm::radians(cam.fovYDegrees) * 0.5f);
+  for(int y = 0; y < h; ++y)
+    for(int x = 0; x < w; ++x) {
+      float px = ((x + 0.5f) / float(w)) * 2.f - 1.f;
+      float py = 1.f - ((y + 0.5f) / float(h)) * 2.f;
+      glm::vec3 dirCam = glm::normalize(glm::vec3(px * cam.aspect * tanHalf, py * tanHalf, -1.f));
+      glm::vec3 rd = glm::normalize(glm::vec3(cam.invView * glm::vec4(dirCam, 0.f)));
+      rays.push_back(RTRay(cam.pos, rd));
+    }
+  return rays;
+}
+
+// rays of a w x h image in row order, reordered into 4x4 pixel blocks (the
+// blocks of the last columns and rows may be smaller)
+static std::vector<RTRay> packetOrder(const std::vector<RTRay> &rays, int w, int h)
+{
+  std::vector<RTRay> out;
+  out.reserve(rays.size());
+  for(int by = 0; by < h; by += 4)
+    for(int bx = 0; bx < w; bx += 4)
+      for(int y = by; y < std::min(by + 4, h); ++y)
+        for(int x = bx; x < std::min(bx + 4, w); ++x)
+          out.push_back(rays[y * w + x]);
+  return out;
+}
+
+static BenchResult runScene(BenchScene &b, const BenchOptions &opt)
+{
+  BenchResult r;
+  r.name = b.name;
+  r.source = b.source;
+  r.triangles = triangleCount(b.scene);
+
+  RayTracer tracer(opt.width, opt.height);
+  tracer.setThreadCount(opt.threads);
+  // the single mesh scenes have no ground: no plane is traced or shadow
+  // tested, so their frame figures only cover the mesh
+  r.ground = b.groundMat >= 0;
+  tracer.setGround(STAGE_GROUND_Y, b.groundMat, STAGE_SHADOW_STRENGTH);
+
+  // SAH last: the ray measurements below use its tree
+  const BVHBuildMode modes[] = { BVHBuildMode::Median, BVHBuildMode::LBVH, BVHBuildMode::LBVHTreelet, BVHBuildMode::SAH };
+  double *buildMs[] = { &r.buildMedianMs, &r.buildLbvhMs, &r.buildLbvhTreeletMs, &r.buildSahMs };
+  for(int m = 0; m < 4; ++m) {
+    *buildMs[m] = 1e30;
+    tracer.setBVHBuildMode(modes[m]);
+    for(int rep = 0; rep < opt.reps; ++rep) {
+      Clock::time_point t0 = Clock::now();
+      tracer.buildBVH(b.scene);
+      *buildMs[m] = std::min(*buildMs[m], msSince(t0));
+    }
+  }
+
+  // primary rays, closest hit, one thread
+  std::vector<RTRay> rays = primaryRays(b.cam, opt.width, opt.height);
+  std::vector<RTRay> shadow;
+  r.primaryRays = rays.size();
+  r.primaryMs = 1e30;
+  for(int rep = 0; rep < opt.reps; ++rep) {
+    shadow.clear();
+    Clock::time_point t0 = Clock::now();
+    for(const RTRay &ray : rays) {
+      RTHit hit;
+      if(!tracer.intersect(ray, hit)) continue;
+      shadow.push_back(RTRay(ray.o + hit.t * ray.d - 1e-4f * ray.d, glm::vec3(0.f)));
+    }
+    r.primaryMs = std::min(r.primaryMs, msSince(t0));
+  }
+  r.primaryHitRate = rays.empty() ? 0.0 : double(shadow.size()) / double(rays.size());
+
+  // the same camera rays in 4x4 pixel packets
+  std::vector<RTRay> packets = packetOrder(rays, opt.width, opt.height);
+  r.primaryPacketMs = 1e30;
+  for(int rep = 0; rep < opt.reps; ++rep) {
+    size_t hitCount = 0;
+    Clock::time_point t0 = Clock::now();
+    for(size_t i = 0; i < packets.size(); i += 16) {
+      RTHit hits[16];
+      int n = (int)std::min<size_t>(16, packets.size() - i);
+      hitCount += tracer.intersectPacket(&packets[i], n, hits);
+    }
+    r.primaryPacketMs = std::min(r.primaryPacketMs, msSince(t0));
+    if(hitCount != shadow.size()) {
+      std::cerr << "[rtbench] packet and single ray traversal disagree on " << b.name << std::endl;
+      std::exit(EXIT_FAILURE);
+    }
+  }
+
+  // shadow rays from the primary hits to the light, any hit, one thread
+  std::vector<float> shadowTMax(shadow.size());
+  for(size_t i = 0; i < shadow.size(); ++i) {
+    glm::vec3 toL = b.light.position - shadow[i].o;
+    float dist = glm::length(toL);
+    shadow[i] = RTRay(shadow[i].o, toL / dist);
+    shadowTMax[i] = dist - 1e-3f;
+  }
+  r.shadowRays = shadow.size();
+  ShadowTiming scanline = timeShadowRays(tracer, shadow, shadowTMax, false, opt.reps);
+  r.shadowMs = scanline.ms;
+  r.shadowNodesPerRay = scanline.nodesPerRay;
+  r.shadowMissesPerRay = scanline.missesPerRay;
+
+  // the same rays in random order, as secondary rays of a path tracer would
+  // come, traced as they are and binned by octant and origin (the binning
+  // counts in the timing)
+  std::vector<int> perm(shadow.size());
+  for(size_t i = 0; i < perm.size(); ++i) perm[i] = (int)i;
+  std::shuffle(perm.begin(), perm.end(), std::mt19937(1234));
+  std::vector<RTRay> shuffled;
+  std::vector<float> shuffledTMax;
+  for(int i : perm) {
+    shuffled.push_back(shadow[i]);
+    shuffledTMax.push_back(shadowTMax[i]);
+  }
+  ShadowTiming incoherent = timeShadowRays(tracer, shuffled, shuffledTMax, false, opt.reps);
+  ShadowTiming binned = timeShadowRays(tracer, shuffled, shuffledTMax, true, opt.reps);
+  r.shadowShuffledMs = incoherent.ms;
+  r.shadowShuffledMissesPerRay = incoherent.missesPerRay;
+  r.shadowBinnedMs = binned.ms;
+  r.shadowBinnedMissesPerRay = binned.missesPerRay;
+
+  // full shaded frame on the thread pool
+  r.frameMs = 1e30;
+  for(int rep = 0; rep < opt.reps; ++rep) {
+    Clock::time_point t0 = Clock::now();
+    tracer.render(b.scene, b.cam, b.light);
+    r.frameMs = std::min(r.frameMs, msSince(t0));
+  }
+  r.frameRays = tracer.stats().rays;
+
+  // the same frame through the wavefront pipeline
+  tracer.setPipeline(RTPipeline::Wavefront);
+  r.frameWavefrontMs = 1e30;
+  for(int rep = 0; rep < opt.reps; ++rep) {
+    Clock::time_point t0 = Clock::now();
+    tracer.render(b.scene, b.cam, b.light);
+    r.frameWavefrontMs = std::min(r.frameWavefrontMs, msSince(t0));
+  }
+  tracer.setPipeline(RTPipeline::PerPixel);
+
+  // camera rays and frame again over quantized nodes
+  r.bvhBytesPerTri = r.triangles ? double(tracer.bvhMemoryBytes(true)) / r.triangles : 0.0;
+  tracer.setBVHLayout(BVHLayout::Wide4Quantized);
+  tracer.buildBVH(b.scene);
+  r.bvhQuantizedBytesPerTri = r.triangles ? double(tracer.bvhMemoryBytes(true)) / r.triangles : 0.0;
+
+  r.primaryQuantizedMs = 1e30;
+  for(int rep = 0; rep < opt.reps; ++rep) {
+    size_t hitCount = 0;
+    Clock::time_point t0 = Clock::now();
+    for(const RTRay &ray : rays) {
+      RTHit hit;
+      if(tracer.intersect(ray, hit)) ++hitCount;
+    }
+    r.primaryQuantizedMs = std::min(r.primaryQuantizedMs, msSince(t0));
+    if(hitCount != shadow.size()) {
+      std::cerr << "[rtbench] quantized and full precision nodes disagree on " << b.name << std::endl;
+      std::exit(EXIT_FAILURE);
+    }
+  }
+
+  r.frameQuantizedMs = 1e30;
+  for(int rep = 0; rep < opt.reps; ++rep) {
+    Clock::time_point t0 = Clock::now();
+    tracer.render(b.scene, b.cam, b.light);
+    r.frameQuantizedMs = std::min(r.frameQuantizedMs, msSince(t0));
+  }
+  tracer.setBVHLayout(BVHLayout::Wide4);
+
+  // the frame again with octahedral normals and half precision uvs
+  RTScene compact = b.scene;
+  reencode(compact.tris, RTVertexFormat::Compact);
+  for(RTMesh &m : compact.meshes) reencode(m.tris, RTVertexFormat::Compact);
+  r.sceneBytesPerTri = geometryBytesPerTri(b.scene);
+  r.sceneCompactBytesPerTri = geometryBytesPerTri(compact);
+
+  tracer.buildBVH(compact);
+  r.frameCompactMs = 1e30;
+  for(int rep = 0; rep < opt.reps; ++rep) {
+    Clock::time_point t0 = Clock::now();
+    tracer.render(compact, b.cam, b.light);
+    r.frameCompactMs = std::min(r.frameCompactMs, msSince(t0));
+  }
+
+  return r;
+}
+
+static double mraysPerSecond(unsigned long long rays, double ms)
+{
+  return ms > 0.0 ? double(rays) / (ms * 1e3) : 0.0;
+}
+
+// the value, or null for the counters that could not be read
+static std::string jsonOrNull(double v)
+{
+  if(v < 0.0) return "null";
+  char buf[32];
+  snprintf(buf, sizeof(buf), "%.3f", v);
+  return buf;
+}
+
+static void writeJSON(FILE *f, const BenchOptions &opt, const std::vector<BenchResult> &results)
+{
+  int threads = opt.threads > 0 ? opt.threads : std::max(1, (int)std::thread::hardware_concurrency());
+
+  fprintf(f, "{\n");
+  fprintf(f, "  \"width\": %d,\n  \"height\": %d,\n  \"reps\": %d,\n  \"frame_threads\": %d,\n",
+          opt.width, opt.height, opt.reps, threads);
+  fprintf(f, "  \"scenes\": [\n");
+  for(size_t i = 0; i < results.size(); ++i) {
+    const BenchResult &r = results[i];
+    fprintf(f, "    {\n");
+    fprintf(f, "      \"name\": \"%s\",\n      \"source\": \"%s\",\n      \"triangles\": %zu,\n      \"ground\": %s,\n",
+            r.name.c_str(), r.source.c_str(), r.triangles, r.ground ? "true" : "false");
+    fprintf(f, "      \"build_sah_ms\": %.3f,\n      \"build_median_ms\": %.3f,\n", r.buildSahMs, r.buildMedianMs);
+    fprintf(f, "      \"build_lbvh_ms\": %.3f,\n      \"build_lbvh_treelet_ms\": %.3f,\n", r.buildLbvhMs, r.buildLbvhTreeletMs);
+    fprintf(f, "      \"primary_rays\": %llu,\n      \"primary_ms\": %.3f,\n      \"primary_mrays_per_s\": %.3f,\n      \"primary_hit_rate\": %.4f,\n",
+            r.primaryRays, r.primaryMs, mraysPerSecond(r.primaryRays, r.primaryMs), r.primaryHitRate);
+    fprintf(f, "      \"primary_packet_ms\": %.3f,\n      \"primary_packet_mrays_per_s\": %.3f,\n",
+            r.primaryPacketMs, mraysPerSecond(r.primaryRays, r.primaryPacketMs));
+    fprintf(f, "      \"shadow_rays\": %llu,\n      \"shadow_ms\": %.3f,\n      \"shadow_mrays_per_s\": %.3f,\n",
+            r.shadowRays, r.shadowMs, mraysPerSecond(r.shadowRays, r.shadowMs));
+    fprintf(f, "      \"shadow_nodes_per_ray\": %.3f,\n      \"shadow_cache_misses_per_ray\": %s,\n",
+            r.shadowNodesPerRay, jsonOrNull(r.shadowMissesPerRay).c_str());
+    fprintf(f, "      \"shadow_shuffled_ms\": %.3f,\n      \"shadow_shuffled_cache_misses_per_ray\": %s,\n",
+            r.shadowShuffledMs, jsonOrNull(r.shadowShuffledMissesPerRay).c_str());
+    fprintf(f, "      \"shadow_binned_ms\": %.3f,\n      \"shadow_binned_cache_misses_per_ray\": %s,\n",
+            r.shadowBinnedMs, jsonOrNull(r.shadowBinnedMissesPerRay).c_str());
+    fprintf(f, "      \"frame_rays\": %llu,\n      \"frame_ms\": %.3f,\n      \"frame_mrays_per_s\": %.3f,\n",
+            r.frameRays, r.frameMs, mraysPerSecond(r.frameRays, r.frameMs));
+    fprintf(f, "      \"frame_wavefront_ms\": %.3f,\n      \"frame_wavefront_mrays_per_s\": %.3f,\n",
+            r.frameWavefrontMs, mraysPerSecond(r.frameRays, r.frameWavefrontMs));
+    fprintf(f, "      \"bvh_bytes_per_tri\": %.1f,\n      \"bvh_quantized_bytes_per_tri\": %.1f,\n",
+            r.bvhBytesPerTri, r.bvhQuantizedBytesPerTri);
+    fprintf(f, "      \"primary_quantized_ms\": %.3f,\n      \"frame_quantized_ms\": %.3f,\n",
+            r.primaryQuantizedMs, r.frameQuantizedMs);
+    fprintf(f, "      \"scene_bytes_per_tri\": %.1f,\n      \"scene_compact_bytes_per_tri\": %.1f,\n      \"frame_compact_ms\": %.3f\n",
+            r.sceneBytesPerTri, r.sceneCompactBytesPerTri, r.frameCompactMs);
+    fprintf(f, "    }%s\n", i + 1 < results.size() ? "," : "");
+  }
+  fprintf(f, "  ]\n}\n");
+}
+
+int main(int argc, char **argv)
+{
+  BenchOptions opt = parseArgs(argc, argv);
+
+  // the mesh loaders log to std::cout; keep stdout for the JSON
+  std::cout.rdbuf(std::cerr.rdbuf());
+
+  float aspect = float(opt.width) / float(opt.height);
+
+  std::vector<BenchResult> results;
+  try {
+    BenchScene backRock = singleMeshScene("rock_back", "data/rock_back.obj", aspect);
+    results.push_back(runScene(backRock, opt));
+
+    BenchScene rhino = singleMeshScene("rhino2", "data/rhino2.off", aspect);
+    results.push_back(runScene(rhino, opt));
+
+    BenchScene stage = stageScene(opt.frog, aspect);
+    results.push_back(runScene(stage, opt));
+  } catch(std::exception &e) {
+    std::cerr << "[Error loading benchmark scenes] " << e.what() << std::endl;
+    return EXIT_FAILURE;
+  }
+
+  FILE *f = opt.out.empty() ? stdout : fopen(opt.out.c_str(), "w");
+  if(!f) {
+    std::cerr << "[Error] cannot write " << opt.out << std::endl;
+    return EXIT_FAILURE;
+  }
+  writeJSON(f, opt, results);
+  if(f != stdout) fclose(f);
+
+  return EXIT_SUCCESS;
+}